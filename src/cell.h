@@ -13,14 +13,10 @@ enum { CT_DATA = 0, CT_CODE, CT_VARD, CT_VIEWH, CT_VARU, CT_VIEWV };
 */
 enum { DS_GRID, DS_BLOBSHIER, DS_BLOBLINE };
 
-/**
-    The Cell structure represents the editable cells in the sheet.
-
-    They are mutable structures containing a text and grid object. Along with
-    formatting information.
-*/
-struct Cell {
-    Cell *parent;
+// What Layout() computes for a cell, and the subtree counts cached along with it. Most cells are
+// never laid out (the clones in the undo history, cells in folded grids, the clipboard), so this
+// is allocated by the first layout of a cell rather than carried by every one of them.
+struct CellLayout {
     int sx {0};
     int sy {0};
     int ox {0};
@@ -30,16 +26,39 @@ struct Cell {
     int ycenteroff {0};
     int txs {0};
     int tys {0};
+    int subtreecells {0};
+    size_t subtreebytes {0};  // cached by CacheCounts() on layout, valid while countsvalid
+    bool countsvalid {false};
+    bool tiny {false};
+
+    static void *operator new(size_t size) {
+        ASSERT(size == sizeof(CellLayout));
+        return BlockPool<sizeof(CellLayout)>::Get().Alloc();
+    }
+    static void operator delete(void *p) { BlockPool<sizeof(CellLayout)>::Get().Free(p); }
+};
+
+/**
+    The Cell structure represents the editable cells in the sheet.
+
+    They are mutable structures containing a text and grid object. Along with
+    formatting information.
+*/
+struct Cell {
+    Cell *parent;
     int celltype;
-    Text text;
-    shared_ptr<Grid> grid;
     uint cellcolor {g_cellcolor_default};
     uint actualcellcolor {g_cellcolor_default};
     uint textcolor {g_textcolor_default};
-    bool tiny {false};
+    int slot {-1};  // index in parent->grid->cells when last seen there, see Grid::FindCell()
     bool verticaltextandgrid {true};
     wxUint8 drawstyle {DS_GRID};
-    wxString note;
+    uint *tagcolor {nullptr};  // cached by TagColor(), valid while tagstamp == doc->TagStamp()
+    long tagstamp {-1};
+    unique_ptr<CellLayout> layout;  // see L()
+    shared_ptr<Grid> grid;
+    Text text;
+    SparseString note;  // few cells have one
 
     Cell(Cell *_p = nullptr, const Cell *_clonefrom = nullptr, int _ct = CT_DATA,
          const shared_ptr<Grid> &_g = nullptr)
@@ -53,6 +72,38 @@ struct Cell {
         if (_clonefrom != nullptr) { CloneStyleFrom(_clonefrom); }
     }
 
+    // For Clone(): copies what it needs straight from o, which saves default constructing the
+    // text and then overwriting it.
+    Cell(const Cell &o, Cell *_p)
+        : parent(_p),
+          celltype(o.celltype),
+          cellcolor(o.cellcolor),
+          textcolor(o.textcolor),
+          verticaltextandgrid(o.verticaltextandgrid),
+          drawstyle(o.drawstyle),
+          text(o.text),
+          note(o.note) {
+        text.cell = this;
+    }
+
+    // Documents consist of mostly cells, so they come from a pool rather than the heap.
+    static void *operator new(size_t size) {
+        ASSERT(size == sizeof(Cell));
+        return BlockPool<sizeof(Cell)>::Get().Alloc();
+    }
+    static void operator delete(void *p) { BlockPool<sizeof(Cell)>::Get().Free(p); }
+
+    // The layout to fill in, allocated on first use. Read through a const cell, a cell that was
+    // never laid out has an all zero layout, as if it had just been Reset().
+    CellLayout &L() {
+        if (!layout) { layout = make_unique<CellLayout>(); }
+        return *layout;
+    }
+    const CellLayout &L() const {
+        static const CellLayout none;
+        return layout ? *layout : none;
+    }
+
     void Clear() {
         grid = nullptr;
         text.t.Clear();
@@ -60,7 +111,7 @@ struct Cell {
         Reset();
     }
 
-    bool HasText() const { return !text.t.empty(); }
+    bool HasText() const { return !text.t.IsEmpty(); }
     bool HasTextSize() const { return HasText() || text.relsize != 0; }
     bool HasTextState() const { return HasTextSize() || text.image != nullptr; }
     bool HasHeader() const { return HasText() || text.image != nullptr; }
@@ -81,61 +132,88 @@ struct Cell {
         return rs;
     }
 
+    // Adds the bytes and cells of this subtree, reusing the totals of any subtree that hasn't
+    // been reset since it was last laid out, so only the changed paths are walked again.
+    void Count(size_t &bytes, int &cells) {
+        if (layout && layout->countsvalid) {
+            bytes += layout->subtreebytes;
+            cells += layout->subtreecells;
+            return;
+        }
+        bytes += sizeof(Cell) + text.EstimatedMemoryUse();
+        cells++;
+        if (grid) { grid->Count(bytes, cells); }
+    }
+
+    void CacheCounts() {
+        auto &l = L();
+        l.countsvalid = false;
+        l.subtreebytes = 0;
+        l.subtreecells = 0;
+        Count(l.subtreebytes, l.subtreecells);
+        l.countsvalid = true;
+    }
+
     size_t EstimatedMemoryUse() {
-        return sizeof(Cell) + text.EstimatedMemoryUse() + (grid ? grid->EstimatedMemoryUse() : 0);
+        size_t bytes = 0;
+        int cells = 0;
+        Count(bytes, cells);
+        return bytes;
     }
 
     template<typename DC>
     void Layout(Document *doc, DC &dc, int depth, int maxcolwidth, bool forcetiny) {
-        tiny = text.filtered && !grid || forcetiny ||
-               doc->PickFont(dc, depth, text.relsize, text.stylebits);
+        auto &l = L();
+        l.tiny = text.filtered && !grid || forcetiny ||
+                 doc->PickFont(dc, depth, text.relsize, text.stylebits);
         int ixs = 0;
         int iys = 0;
-        if (!tiny) { treesheets::System::ImageSize(text.DisplayImage(), ixs, iys); }
+        if (!l.tiny) { treesheets::System::ImageSize(text.DisplayImage(), ixs, iys); }
         int leftoffset = 0;
         if (!HasText()) {
             if (ixs == 0 || iys == 0) {
-                sx = sy = tiny ? 1 : dc.GetCharHeight();
+                l.sx = l.sy = l.tiny ? 1 : dc.GetCharHeight();
             } else {
                 leftoffset = dc.GetCharHeight();
             }
         } else {
-            text.TextSize(dc, sx, sy, static_cast<int>(tiny), leftoffset, maxcolwidth);
+            text.TextSize(dc, l.sx, l.sy, static_cast<int>(l.tiny), leftoffset, maxcolwidth);
         }
         if (ixs != 0 && iys != 0) {
-            sx += ixs + 2;
-            sy = max(iys + 2, sy);
+            l.sx += ixs + 2;
+            l.sy = max(iys + 2, l.sy);
         }
-        text.extent = sx + depth * dc.GetCharHeight();
-        txs = sx;
-        tys = sy;
+        text.extent = l.sx + depth * dc.GetCharHeight();
+        l.txs = l.sx;
+        l.tys = l.sy;
         if (GridShown(doc)) {
             if (HasHeader()) {
                 if (verticaltextandgrid) {
-                    int osx = sx;
-                    if (drawstyle == DS_BLOBLINE && !tiny) { sy += 4; }
-                    grid->Layout(doc, dc, depth, sx, sy, leftoffset, sy, tiny || forcetiny);
-                    sx = max(sx, osx);
+                    int osx = l.sx;
+                    if (drawstyle == DS_BLOBLINE && !l.tiny) { l.sy += 4; }
+                    grid->Layout(doc, dc, depth, l.sx, l.sy, leftoffset, l.sy, l.tiny || forcetiny);
+                    l.sx = max(l.sx, osx);
                 } else {
-                    int osy = sy;
-                    if (drawstyle == DS_BLOBLINE && !tiny) { sx += 18; }
-                    grid->Layout(doc, dc, depth, sx, sy, sx, 0, tiny || forcetiny);
-                    sy = max(sy, osy);
+                    int osy = l.sy;
+                    if (drawstyle == DS_BLOBLINE && !l.tiny) { l.sx += 18; }
+                    grid->Layout(doc, dc, depth, l.sx, l.sy, l.sx, 0, l.tiny || forcetiny);
+                    l.sy = max(l.sy, osy);
                 }
             } else {
-                tiny = grid->Layout(doc, dc, depth, sx, sy, 0, 0, forcetiny);
+                l.tiny = grid->Layout(doc, dc, depth, l.sx, l.sy, 0, 0, forcetiny);
             }
         }
-        ycenteroff = !verticaltextandgrid ? (sy - tys) / 2 : 0;
-        if (!tiny) {
-            sx += g_margin_extra * 2;
-            sy += g_margin_extra * 2;
+        l.ycenteroff = !verticaltextandgrid ? (l.sy - l.tys) / 2 : 0;
+        if (!l.tiny) {
+            l.sx += g_margin_extra * 2;
+            l.sy += g_margin_extra * 2;
         }
     }
 
     template<typename DCType>
     void Render(Document *doc, int bx, int by, DCType &dc, int depth, int ml, int mr, int mt,
                 int mb, int maxcolwidth, int cell_margin) {
+        auto &l = L();
         // Choose color from celltype (program operations)
         switch (celltype) {
             case CT_VARD: actualcellcolor = 0xFF8080; break;
@@ -160,9 +238,9 @@ struct Cell {
         }
 
         if (drawstyle == DS_GRID && actualcellcolor != parentcolor) {
-            DrawRectangle(dc, actualcellcolor, bx - ml, by - mt, sx + ml + mr, sy + mt + mb);
+            DrawRectangle(dc, actualcellcolor, bx - ml, by - mt, l.sx + ml + mr, l.sy + mt + mb);
         }
-        if (drawstyle != DS_GRID && HasContent() && !tiny) {
+        if (drawstyle != DS_GRID && HasContent() && !l.tiny) {
             if (actualcellcolor == parentcolor) {
                 auto *cp = reinterpret_cast<uchar *>(&actualcellcolor);
                 loop(i, 4) cp[i] = cp[i] * 850 / 1000;
@@ -171,28 +249,29 @@ struct Cell {
             dc.SetPen(wxPen(LightColor(actualcellcolor)));
 
             if (drawstyle == DS_BLOBSHIER) {
-                dc.DrawRoundedRectangle(bx - cell_margin, by - cell_margin, minx + cell_margin * 2,
-                                        miny + cell_margin * 2, sys->roundness);
+                dc.DrawRoundedRectangle(bx - cell_margin, by - cell_margin,
+                                        l.minx + cell_margin * 2, l.miny + cell_margin * 2,
+                                        sys->roundness);
             } else if (HasHeader()) {
                 dc.DrawRoundedRectangle(bx - cell_margin + g_margin_extra / 2,
-                                        by - cell_margin + ycenteroff + g_margin_extra / 2,
-                                        txs + cell_margin * 2 + g_margin_extra,
-                                        tys + cell_margin * 2 + g_margin_extra, sys->roundness);
+                                        by - cell_margin + l.ycenteroff + g_margin_extra / 2,
+                                        l.txs + cell_margin * 2 + g_margin_extra,
+                                        l.tys + cell_margin * 2 + g_margin_extra, sys->roundness);
             // FIXME: this half a g_margin_extra is a bit of hack
             }
         }
         dc.SetTextBackground(LightColor(actualcellcolor));
         int xoff = verticaltextandgrid ? 0 : text.extent - depth * dc.GetCharHeight();
-        int yoff = text.Render(doc, bx, by + ycenteroff, depth, dc, xoff, maxcolwidth);
+        int yoff = text.Render(doc, bx, by + l.ycenteroff, depth, dc, xoff, maxcolwidth);
         yoff = verticaltextandgrid ? yoff : 0;
         if (GridShown(doc)) {
-            grid->Render(doc, bx, by, dc, depth, sx - xoff, sy - yoff, xoff, yoff);
+            grid->Render(doc, bx, by, dc, depth, l.sx - xoff, l.sy - yoff, xoff, yoff);
         }
 
-        if (!note.IsEmpty() && !tiny && this != doc->currentdrawroot) {
+        if (!note.IsEmpty() && !l.tiny && this != doc->currentdrawroot) {
             wxPoint points[3];
             int size = 6;
-            int right = bx + sx + mr;
+            int right = bx + l.sx + mr;
             int top = by - mt;
             points[0] = wxPoint(right, top);
             points[1] = wxPoint(right, top + size);
@@ -211,22 +290,28 @@ struct Cell {
         text.stylebits = o->text.stylebits;
     }
 
+    // Shares the text buffers with this subtree, see CompactString.
     unique_ptr<Cell> Clone(Cell *_parent) const {
-        unique_ptr<Cell> c = make_unique<Cell>(_parent, this, celltype,
-                                               grid ? make_shared<Grid>(grid->xs, grid->ys) : nullptr);
-        c->text = text;
-        c->text.cell = c.get();
-        c->note = note;
-        if (grid) { grid->Clone(c->grid); }
+        // With the size of the subtree known from the last layout, the pool makes room for all
+        // of the copy at once, rather than growing chunk by chunk as it goes.
+        if (grid && layout && layout->countsvalid) {
+            BlockPool<sizeof(Cell)>::Get().Reserve(layout->subtreecells);
+        }
+        auto c = make_unique<Cell>(*this, _parent);
+        if (grid) {
+            c->grid = make_pooled<Grid>(grid->xs, grid->ys);
+            c->grid->cell = c.get();
+            grid->Clone(c->grid);
+        }
         return c;
     }
 
-    bool IsInside(int x, int y) const { return x >= 0 && y >= 0 && x < sx && y < sy; }
+    bool IsInside(int x, int y) const { return x >= 0 && y >= 0 && x < L().sx && y < L().sy; }
     int GetX(Document *doc) const {
-        return ox + (parent != nullptr ? parent->GetX(doc) : doc->hierarchysize);
+        return L().ox + (parent != nullptr ? parent->GetX(doc) : doc->hierarchysize);
     }
     int GetY(Document *doc) const {
-        return oy + (parent != nullptr ? parent->GetY(doc) : doc->hierarchysize);
+        return L().oy + (parent != nullptr ? parent->GetY(doc) : doc->hierarchysize);
     }
     int Depth() const { return parent != nullptr ? parent->Depth() + 1 : 0; }
     Cell *Parent(int i) { return i != 0 ? parent->Parent(i - 1) : this; }
@@ -238,9 +323,11 @@ struct Cell {
         return c->parent == this || (c->parent != nullptr && IsParentOf(c->parent));
     }
 
-    wxString ToText(int indent, const Selection &sel, int format, Document *doc, bool inheritstyle,
-                    Cell *root) {
-        wxString str = text.ToText(indent, sel, format);
+    // Writes this cell in export format format, appending to w in document order so that it can
+    // be streamed out as it goes.
+    void ToText(TextWriter &w, int indent, const Selection &sel, int format, Document *doc,
+                bool inheritstyle, Cell *root) {
+        wxString str = text.ToText(indent, sel, format, w.settings.dipscale);
         if ((format == A_EXPHTMLT || format == A_EXPHTMLTI || format == A_EXPHTMLTE) &&
             this != root && !str.IsEmpty()) {
             wxString spanstyle = "white-space: pre-wrap;";
@@ -253,44 +340,37 @@ struct Cell {
             str.Prepend("<span style=\"" + spanstyle + "\">");
             str.Append("</span>");
         }
+        auto &r = w.text;
         if (format == A_EXPCSV) {
-            if (grid) { return grid->ToText(indent, sel, format, doc, inheritstyle, root); }
+            if (grid) {
+                grid->ToText(w, indent, sel, format, doc, inheritstyle, root);
+                return;
+            }
             str.Replace("\"", "\"\"");
-            return "\"" + str + "\"";
+            r.Append('"');
+            r.Append(str);
+            r.Append('"');
+            return;
+        }
+        if (sel.cursor != sel.cursorend) {
+            r.Append(str);
+            return;
         }
-        if (sel.cursor != sel.cursorend) { return str; }
-        str.Append(LINE_SEPARATOR);
-        if (grid) { str.Append(grid->ToText(indent, sel, format, doc, inheritstyle, root)); }
+        r.Append(' ', indent);
+        wxString close;
         if (format == A_EXPXML) {
-            str.Prepend(">");
-            if (text.relsize != 0) {
-                str.Prepend("\"");
-                str.Prepend(wxString() << -text.relsize);
-                str.Prepend(" relsize=\"");
-            }
-            if (text.stylebits != 0) {
-                str.Prepend("\"");
-                str.Prepend(wxString() << text.stylebits);
-                str.Prepend(" stylebits=\"");
-            }
-            if (cellcolor != 0xFFFFFF) {
-                str.Prepend("\"");
-                str.Prepend(wxString::Format("0x%06X", cellcolor));
-                str.Prepend(" colorbg=\"");
-            }
+            r.Append("<cell");
+            if (celltype != CT_DATA) { r << " type=\"" << celltype << "\""; }
             if (textcolor != 0x000000) {
-                str.Prepend("\"");
-                str.Prepend(wxString::Format("0x%06X", textcolor));
-                str.Prepend(" colorfg=\"");
+                r << " colorfg=\"" << wxString::Format("0x%06X", textcolor) << "\"";
             }
-            if (celltype != CT_DATA) {
-                str.Prepend("\"");
-                str.Prepend(wxString() << celltype);
-                str.Prepend(" type=\"");
+            if (cellcolor != 0xFFFFFF) {
+                r << " colorbg=\"" << wxString::Format("0x%06X", cellcolor) << "\"";
             }
-            str.Prepend("<cell");
-            str.Append(' ', indent);
-            str.Append("</cell>\n");
+            if (text.stylebits != 0) { r << " stylebits=\"" << text.stylebits << "\""; }
+            if (text.relsize != 0) { r << " relsize=\"" << -text.relsize << "\""; }
+            r.Append(">");
+            close = "</cell>\n";
         } else if ((format == A_EXPHTMLT || format == A_EXPHTMLTI || format == A_EXPHTMLTE) &&
                    this != root) {
             wxString style;
@@ -308,37 +388,40 @@ struct Cell {
                 (text.stylebits & STYLE_FIXED) != (parent->text.stylebits & STYLE_FIXED)) {
                 style += "font-family: '";
                 style += (text.stylebits & STYLE_FIXED) != 0
-                             ? sys->defaultfixedfont + "', monospace;"
-                             : sys->defaultfont + "', sans-serif;";
+                             ? w.settings.fixedfont + "', monospace;"
+                             : w.settings.font + "', sans-serif;";
             }
             if (!inheritstyle ||
                 cellcolor != (parent != nullptr ? parent->cellcolor : doc->Background())) {
                 style += wxString::Format("background-color: #%06X;", SwapColor(cellcolor));
             }
-            auto exporttextcolor = IsTag(doc) ? doc->tags[text.t] : textcolor;
-            auto parenttextcolor =
-                parent != nullptr
-                    ? parent->IsTag(doc) ? doc->tags[parent->text.t] : parent->textcolor
-                    : 0x000000;
+            auto tagcolor = TagColor(doc);
+            auto exporttextcolor = tagcolor != nullptr ? *tagcolor : textcolor;
+            auto parenttagcolor = parent != nullptr ? parent->TagColor(doc) : nullptr;
+            auto parenttextcolor = parenttagcolor != nullptr ? *parenttagcolor
+                                   : parent != nullptr       ? parent->textcolor
+                                                             : 0x000000;
             if (!inheritstyle || exporttextcolor != parenttextcolor) {
                 style += wxString::Format("color: #%06X;", SwapColor(exporttextcolor));
             }
-            str.Prepend(style.IsEmpty() ? wxString("<td>")
-                                        : wxString("<td style=\"") + style + wxString("\">"));
-            str.Append(' ', indent);
-            str.Append("</td>\n");
+            r.Append(style.IsEmpty() ? wxString("<td>")
+                                     : wxString("<td style=\"") + style + wxString("\">"));
+            close = "</td>\n";
         } else if (format == A_EXPHTMLB && (!text.t.IsEmpty() || grid) && this != root) {
-            str.Prepend("<li>");
-            str.Append(' ', indent);
-            str.Append("</li>\n");
+            r.Append("<li>");
+            close = "</li>\n";
         } else if (format == A_EXPHTMLO && !text.t.IsEmpty()) {
             wxString h = wxString("h") + static_cast<wxChar>('0' + indent / 2) + ">";
-            str.Prepend("<" + h);
-            str.Append(' ', indent);
-            str.Append("</" + h + "\n");
+            r.Append("<" + h);
+            close = "</" + h + "\n";
+        }
+        r.Append(str);
+        r.Append(LINE_SEPARATOR);
+        if (grid) { grid->ToText(w, indent, sel, format, doc, inheritstyle, root); }
+        if (!close.IsEmpty()) {
+            r.Append(' ', indent);
+            r.Append(close);
         }
-        str.Pad(indent, ' ', false);
-        return str;
     }
 
     void RelSize(int dir, int zoomdepth) {
@@ -346,7 +429,12 @@ struct Cell {
         if (grid) { grid->RelSize(dir, zoomdepth); }
     }
 
-    void Reset() { ox = oy = sx = sy = minx = miny = ycenteroff = 0; }
+    void Reset() {
+        if (!layout) { return; }
+        auto &l = *layout;
+        l.ox = l.oy = l.sx = l.sy = l.minx = l.miny = l.ycenteroff = 0;
+        l.countsvalid = false;
+    }
     void ResetChildren() {
         Reset();
         if (grid) { grid->ResetChildren(); }
@@ -361,13 +449,15 @@ struct Cell {
 
     template<typename DC>
     void LazyLayout(Document *doc, DC &dc, int depth, int maxcolwidth, bool forcetiny) {
-        if (sx == 0) {
+        auto &l = L();
+        if (l.sx == 0) {
             Layout(doc, dc, depth, maxcolwidth, forcetiny);
-            minx = sx;
-            miny = sy;
+            l.minx = l.sx;
+            l.miny = l.sy;
+            CacheCounts();
         } else {
-            sx = minx;
-            sy = miny;
+            l.sx = l.minx;
+            l.sy = l.miny;
         }
     }
 
@@ -376,12 +466,23 @@ struct Cell {
         doc->AddUndo(this);
     }
 
-    void Save(wxDataOutputStream &dos, Cell *ocs) const {
+    // Whether this cell only has the attributes Save() writes for TS_NEITHER, and writing o
+    // instead would give the same file.
+    bool SameBlank(const Cell *o, const Cell *ocs) const {
+        auto blank = [&](const Cell *c) {
+            return !c->HasTextState() && !c->grid && c->note.IsEmpty() && c != ocs;
+        };
+        return blank(this) && blank(o) && celltype == o->celltype && cellcolor == o->cellcolor &&
+               textcolor == o->textcolor && drawstyle == o->drawstyle;
+    }
+
+    // With run > 1, this is saved as the first of run blank cells that are all the same.
+    void Save(wxDataOutputStream &dos, Cell *ocs, int run = 1) const {
         dos.Write8(celltype);
         dos.Write32(cellcolor);
         dos.Write32(textcolor);
         dos.Write8(drawstyle);
-        dos.WriteString(note);
+        WriteUTF8(dos, note);
         uint cellflags = this == ocs ? TS_SELECTION_MASK : 0;
         if (HasTextState()) {
             cellflags |= grid ? TS_BOTH : TS_TEXT;
@@ -392,6 +493,9 @@ struct Cell {
             cellflags |= TS_GRID;
             dos.Write8(cellflags);
             grid->Save(dos, ocs);
+        } else if (run > 1) {
+            dos.Write8(TS_BLANKS);
+            dos.Write32(run);
         } else {
             cellflags |= TS_NEITHER;
             dos.Write8(cellflags);
@@ -400,52 +504,244 @@ struct Cell {
 
     Grid* AddGrid(int x = 1, int y = 1) {
         if (!grid) {
-            grid = make_shared<Grid>(x, y, this);
+            grid = make_pooled<Grid>(x, y, this);
             grid->InitCells(this);
             if (parent != nullptr) { grid->CloneStyleFrom(parent->grid.get()); }
         }
         return grid.get();
     }
 
-    Cell *LoadGrid(wxDataInputStream &dis, int &numcells, int &textbytes, Cell *&ics) {
-        int xs = dis.Read32();
-        int ys = dis.Read32();
-        if (xs < 1 || ys < 1 || static_cast<int64_t>(xs) * ys > g_max_grid_cells) {
-            return nullptr;
-        }
-        auto g = make_shared<Grid>(xs, ys);
-        grid = g;
-        g->cell = this;
-        if (!g->LoadContents(dis, numcells, textbytes, ics)) { return nullptr; }
-        return this;
-    }
-
-    static Cell *LoadWhich(wxDataInputStream &dis, Cell *_p, int &numcells, int &textbytes, Cell *&ics) {
-        auto c = make_unique<Cell>(_p, nullptr, dis.Read8());
-        numcells++;
-        if (sys->versionlastloaded >= 8) {
-            c->cellcolor = dis.Read32() & 0xFFFFFF;
-            c->textcolor = dis.Read32() & 0xFFFFFF;
-        }
-        if (sys->versionlastloaded >= 15) { c->drawstyle = dis.Read8(); }
-        if (sys->versionlastloaded >= 25) { c->note = dis.ReadString(); }
+    // A cell as Save() writes it, up to where the cells of its grid start. Whatever the file's
+    // version doesn't store is left at -1 (or empty).
+    struct Stored {
+        int celltype {CT_DATA};
+        int cellcolor {-1};
+        int textcolor {-1};
+        int drawstyle {-1};
+        wxString note;
+        bool selected {false};
+        bool hastext {false};
+        CompactString text;
+        int relsize {0};
+        int image {-1};
+        int stylebits {0};
+        bool haslastedit {false};
+        wxLongLong lastedit;
+        int xs {0};  // 0 without a grid
+        int ys {0};
+        int bordercolor {-1};
+        int outerspacing {-1};
+        int verticaltextandgrid {-1};
+        bool folded {false};
+        vector<int> colwidths;
+    };
+
+    // The one reader of the format Save() writes, shared by LoadWhich() and ScanWhich(). v gets
+    // Visit(stored) for every cell, with Down(), Child(x, y) before each cell of its grid and
+    // Up() around those, and Repeat(x, y) for the copies in a TS_BLANKS run. A TS_BLANKS run is
+    // only valid inside a grid, which passes repeat to receive the number of copies of the cell
+    // that follow it.
+    template<typename V>
+    static bool WalkWhich(wxDataInputStream &dis, int version, V &v, int *repeat = nullptr) {
+        Stored s;
+        s.celltype = dis.Read8();
+        if (version >= 8) {
+            s.cellcolor = dis.Read32() & 0xFFFFFF;
+            s.textcolor = dis.Read32() & 0xFFFFFF;
+        }
+        if (version >= 15) { s.drawstyle = dis.Read8(); }
+        if (version >= 25) { s.note = ReadUTF8(dis); }
         int ts = dis.Read8();
-        if ((ts & TS_SELECTION_MASK) != 0) {
-            ics = c.get();
-            ts &= ~TS_SELECTION_MASK;
-        }
+        s.selected = (ts & TS_SELECTION_MASK) != 0;
+        ts &= ~TS_SELECTION_MASK;
         switch (ts) {
             case TS_BOTH:
             case TS_TEXT:
-                c->text.Load(dis);
-                textbytes += c->text.t.Len();
-                if (ts == TS_TEXT) { return c.release(); }
+                s.hastext = true;
+                ReadUTF8(dis, s.text);
+                if (version <= 11) { dis.Read32(); }  // numlines
+                s.relsize = dis.Read32();
+                s.image = dis.Read32();
+                if (version >= 7) { s.stylebits = dis.Read32(); }
+                if (version >= 14) {
+                    dis.Read64(&s.lastedit, 1);
+                    s.haslastedit = true;
+                }
+                if (ts == TS_TEXT) { break; }
+                [[fallthrough]];
             case TS_GRID:
-                return c->LoadGrid(dis, numcells, textbytes, ics) != nullptr ? c.release()
-                                                                             : nullptr;
-            case TS_NEITHER: return c.release();
-            default: return nullptr;
-        }
+                s.xs = dis.Read32();
+                s.ys = dis.Read32();
+                if (s.xs < 1 || s.ys < 1 ||
+                    static_cast<int64_t>(s.xs) * s.ys > g_max_grid_cells) {
+                    return false;
+                }
+                if (version >= 10) {
+                    s.bordercolor = dis.Read32() & 0xFFFFFF;
+                    s.outerspacing =
+                        std::clamp(static_cast<int>(dis.Read32()), 0, g_max_grid_outer_spacing);
+                    if (version >= 11) {
+                        s.verticaltextandgrid = dis.Read8() != 0;
+                        if (version >= 13) {
+                            if (version >= 16) {
+                                s.folded = dis.Read8() != 0;
+                                // Before v18, folding would use the image slot. So if this cell
+                                // contains an image, clear it.
+                                if (s.folded && version <= 17) { s.image = -1; }
+                            }
+                            s.colwidths.resize(s.xs);
+                            for (auto &w : s.colwidths) {
+                                w = std::max(static_cast<int>(dis.Read32()), g_min_colwidth);
+                            }
+                        }
+                    }
+                }
+                break;
+            case TS_NEITHER: break;
+            case TS_BLANKS: {
+                auto run = static_cast<int>(dis.Read32());
+                if (repeat == nullptr || run < 2) { return false; }
+                *repeat = run - 1;
+                break;
+            }
+            default: return false;
+        }
+        if (!dis.IsOk()) { return false; }
+        v.Visit(s);
+        if (s.xs == 0) { return true; }
+        v.Down();
+        int blanks = 0;
+        loop(y, s.ys) loop(x, s.xs) {
+            if (blanks > 0) {
+                blanks--;
+                v.Repeat(x, y);
+                continue;
+            }
+            v.Child(x, y);
+            if (!WalkWhich(dis, version, v, &blanks)) { return false; }
+        }
+        v.Up();
+        return blanks == 0;
+    }
+
+    static Cell *LoadWhich(wxDataInputStream &dis, Cell *_p, int &numcells, int &textbytes,
+                           Cell *&ics) {
+        struct Loader {
+            int &numcells;
+            int &textbytes;
+            Cell *&ics;
+            Cell *parent;  // of the next cell
+            int x {0};
+            int y {0};
+            Cell *last {nullptr};  // the cell a TS_BLANKS run copies
+            unique_ptr<Cell> root {nullptr};
+
+            void Visit(Stored &s) {
+                auto c = make_unique<Cell>(parent, nullptr, s.celltype);
+                numcells++;
+                if (s.cellcolor >= 0) { c->cellcolor = s.cellcolor; }
+                if (s.textcolor >= 0) { c->textcolor = s.textcolor; }
+                if (s.drawstyle >= 0) { c->drawstyle = s.drawstyle; }
+                c->note = std::move(s.note);
+                if (s.selected) { ics = c.get(); }
+                if (s.hastext) {
+                    auto &text = c->text;
+                    text.t = std::move(s.text);
+                    textbytes += text.t.Len();
+                    text.relsize = s.relsize;
+                    auto &ids = sys->loadimageids;
+                    text.image = s.image >= 0 && s.image < static_cast<int>(ids.size())
+                                     ? sys->imagelist[ids[s.image]].get()
+                                     : nullptr;
+                    text.stylebits = s.stylebits;
+                    if (!s.haslastedit) { s.lastedit = sys->fakelasteditonload--; }
+                    text.lastedit = wxDateTime(s.lastedit);
+                }
+                if (s.xs > 0) {
+                    auto g = make_pooled<Grid>(s.xs, s.ys, c.get());
+                    c->grid = g;
+                    if (s.bordercolor >= 0) { g->bordercolor = s.bordercolor; }
+                    if (s.outerspacing >= 0) { g->user_grid_outer_spacing = s.outerspacing; }
+                    if (s.verticaltextandgrid >= 0) {
+                        c->verticaltextandgrid = s.verticaltextandgrid != 0;
+                    }
+                    g->folded = s.folded;
+                    loopv(i, s.colwidths) g->colwidths[i] = s.colwidths[i];
+                }
+                last = c.get();
+                if (!root) {
+                    root = std::move(c);
+                } else {
+                    auto *g = parent->grid.get();
+                    c->slot = g->Index(x, y);
+                    g->C(x, y) = std::move(c);
+                }
+            }
+
+            void Down() { parent = last; }
+
+            void Child(int cx, int cy) {
+                x = cx;
+                y = cy;
+            }
+
+            void Repeat(int cx, int cy) {
+                auto *g = parent->grid.get();
+                auto &c = g->C(cx, cy);
+                c = make_unique<Cell>(parent, last, last->celltype);
+                c->slot = g->Index(cx, cy);
+                numcells++;
+            }
+
+            void Up() {
+                last = parent;
+                parent = parent->parent;
+            }
+        } loader {numcells, textbytes, ics, _p};
+        if (!WalkWhich(dis, sys->versionlastloaded, loader)) { return nullptr; }
+        return loader.root.release();
+    }
+
+    // Calls f(text, path, parents) for every cell with text, like LoadWhich() reads them but
+    // without building any cells or touching global state, so it can run on any thread. path
+    // has the (x, y) of each cell from the root down, and parents the text of its ancestors.
+    // Cells inside folded grids are skipped unless withfolded is set.
+    template<typename F>
+    static bool ScanWhich(wxDataInputStream &dis, int version, bool withfolded, F f) {
+        struct Scanner {
+            F &f;
+            bool withfolded;
+            vector<pair<int, int>> path;
+            vector<wxString> parents;
+            vector<bool> infolded;
+            CompactString lasttext;
+            bool lastfolded {false};
+
+            void Visit(Stored &s) {
+                if (s.hastext && (withfolded || infolded.empty() || !infolded.back())) {
+                    f(s.text.Get(), path, parents);
+                }
+                lasttext = std::move(s.text);
+                lastfolded = s.folded;
+            }
+
+            void Down() {
+                path.emplace_back(0, 0);
+                parents.push_back(lasttext.Get());
+                infolded.push_back(lastfolded || (!infolded.empty() && infolded.back()));
+            }
+
+            void Child(int x, int y) { path.back() = {x, y}; }
+
+            void Repeat(int, int) {}
+
+            void Up() {
+                path.pop_back();
+                parents.pop_back();
+                infolded.pop_back();
+            }
+        } scanner {f, withfolded};
+        return WalkWhich(dis, version, scanner);
     }
 
     unique_ptr<Cell> Eval(Evaluator &ev) const {
@@ -463,11 +759,11 @@ struct Cell {
                 textcolor = original->textcolor;
                 text.stylebits = original->text.stylebits;
             }
-            text.Insert(document, original->text.t, selection, false);
+            text.Insert(document, original->text.t.Get(), selection, false);
         }
         if (original->text.image != nullptr) { text.image = original->text.image; }
         if (original->grid) {
-            shared_ptr<Grid> gridclone = make_shared<Grid>(original->grid->xs, original->grid->ys);
+            shared_ptr<Grid> gridclone = make_pooled<Grid>(original->grid->xs, original->grid->ys);
             gridclone->cell = this;
             original->grid->Clone(gridclone);
             // Note: deleting grid may invalidate c if its a child of grid, so clear it.
@@ -479,12 +775,12 @@ struct Cell {
         }
     }
 
-    Cell *FindNextSearchMatch(const wxString &s, Cell *best, Cell *selected, bool &lastwasselected,
-                              bool reverse) {
+    Cell *FindNextSearchMatch(const SearchMatcher &s, Cell *best, Cell *selected,
+                              bool &lastwasselected, bool reverse) {
         if (reverse && grid) {
             best = grid->FindNextSearchMatch(s, best, selected, lastwasselected, reverse);
         }
-        if ((sys->casesensitivesearch ? text.t.Find(s) : text.t.Lower().Find(s)) >= 0) {
+        if (s.Matches(text.t.Get())) {
             if (lastwasselected) { best = this; }
             lastwasselected = false;
         }
@@ -505,33 +801,9 @@ struct Cell {
         return best;
     }
 
-    Cell *FindLink(const Selection &sel, Cell *link, Cell *best, bool &lastthis, bool &stylematch,
-                   bool forward, bool image) {
-        if (grid) { best = grid->FindLink(sel, link, best, lastthis, stylematch, forward, image); }
-        if (link == this) {
-            lastthis = true;
-            return best;
-        }
-        if (image ? link->text.image == text.image
-                  : link->text.ToText(0, sel, A_EXPTEXT) == text.t) {
-            if (link->text.stylebits != text.stylebits || link->cellcolor != cellcolor ||
-                link->textcolor != textcolor) {
-                if (!stylematch) { best = nullptr; }
-                stylematch = true;
-            } else if (stylematch) {
-                return best;
-            }
-            if (best == nullptr || lastthis) {
-                lastthis = false;
-                return this;
-            }
-        }
-        return best;
-    }
-
-    void FindReplaceAll(const wxString &s, const wxString &ls) {
-        if (grid) { grid->FindReplaceAll(s, ls); }
-        text.ReplaceStr(s, ls);
+    void FindReplaceAll(const wxString &s) {
+        if (grid) { grid->FindReplaceAll(s); }
+        text.ReplaceStr(s);
     }
 
     Cell *FindExact(const wxString &s) {
@@ -547,8 +819,8 @@ struct Cell {
         switch (which) {
             case A_CELLCOLOR: cellcolor = color; break;
             case A_TEXTCOLOR:
-                if (IsTag(doc)) {
-                    doc->tags[text.t] = color;
+                if (auto tagcolor = TagColor(doc)) {
+                    *tagcolor = color;
                 } else {
                     textcolor = color;
                 }
@@ -566,7 +838,30 @@ struct Cell {
         if (grid) { grid->SetGridTextLayout(ds, vert, noset, grid->SelectAll()); }
     }
 
-    bool IsTag(Document *doc) { return doc->tags.contains(text.t); }
+    // Returns this cell's color in the tag table, or nullptr if its text is not a tag. The lookup
+    // is only redone after the document or its tags have changed.
+    // Without a document (a copy rendered on its own) only what ResolveTags() found is known.
+    uint *TagColor(Document *doc) {
+        if (doc != nullptr && tagstamp != doc->TagStamp()) {
+            auto it = doc->tags.find(text.t.Get());
+            tagcolor = it != doc->tags.end() ? &it->second : nullptr;
+            tagstamp = doc->TagStamp();
+        }
+        return tagcolor;
+    }
+
+    bool IsTag(Document *doc) { return TagColor(doc) != nullptr; }
+
+    // Points the tag colors of this subtree into tags, which must outlive their use.
+    void ResolveTags(std::unordered_map<wxString, uint, TextHash> &tags) {
+        vector<Cell *> cells;
+        CollectCells(cells);
+        for (auto *c : cells) {
+            auto it = tags.find(c->text.t.Get());
+            c->tagcolor = it != tags.end() ? &it->second : nullptr;
+        }
+    }
+
     void MaxDepthLeaves(int curdepth, int &maxdepth, int &leaves) {
         maxdepth = std::max(curdepth, maxdepth);
         if (grid) {
@@ -1,11 +1,138 @@
+// What style, color and layout changes modify in a cell and in its grid, if it has one. These
+// changes leave the shape of the tree alone, so undoing them swaps this back in place instead of
+// restoring a clone of everything under the selection.
+struct CellStyle {
+    uint cellcolor;
+    uint textcolor;
+    int celltype;
+    int stylebits;
+    int relsize;
+    Image *image;
+    SparseString note;
+    wxDateTime lastedit;
+    bool verticaltextandgrid;
+    wxUint8 drawstyle;
+    int bordercolor {g_bordercolor_default};
+    int outerspacing {g_usergridouterspacing_default};
+
+    CellStyle() = default;
+    explicit CellStyle(const Cell *c)
+        : cellcolor(c->cellcolor),
+          textcolor(c->textcolor),
+          celltype(c->celltype),
+          stylebits(c->text.stylebits),
+          relsize(c->text.relsize),
+          image(c->text.image),
+          note(c->note),
+          lastedit(c->text.lastedit),
+          verticaltextandgrid(c->verticaltextandgrid),
+          drawstyle(c->drawstyle) {
+        if (c->grid) {
+            bordercolor = c->grid->bordercolor;
+            outerspacing = c->grid->user_grid_outer_spacing;
+        }
+    }
+
+    void Swap(Cell *c) {
+        std::swap(cellcolor, c->cellcolor);
+        std::swap(textcolor, c->textcolor);
+        std::swap(celltype, c->celltype);
+        std::swap(stylebits, c->text.stylebits);
+        std::swap(relsize, c->text.relsize);
+        std::swap(image, c->text.image);
+        std::swap(note, c->note);
+        std::swap(lastedit, c->text.lastedit);
+        std::swap(verticaltextandgrid, c->verticaltextandgrid);
+        std::swap(drawstyle, c->drawstyle);
+        if (c->grid) {
+            std::swap(bordercolor, c->grid->bordercolor);
+            std::swap(outerspacing, c->grid->user_grid_outer_spacing);
+        }
+    }
+};
+
 struct UndoItem {
     vector<Selection> path;
     vector<Selection> selpath;
     Selection sel;
     unique_ptr<Cell> clone;
+    // Set instead of clone by AddStyleUndo(): the styles of the cell at path and of the cells in
+    // stylesel (with everything below them if stylesrecursive), in pre-order.
+    vector<CellStyle> styles;
+    vector<int> colwidths;
+    Selection stylesel;
+    bool stylesrecursive {false};
+    // Set instead of clone by AddTextUndo(): undo replaces textnew at textpos in the text of the
+    // cell at path by textold. Until FinishTextUndo() runs, textpos is -1 and textold holds all
+    // of the old text.
+    bool textedit {false};
+    int textpos {-1};
+    wxString textold;
+    wxString textnew;
+    int textrelsize {0};
+    wxDateTime textlastedit;
     size_t estimated_size {0};
     uintptr_t cloned_from {};  // May be dead.
     int generation {0};
+
+    void ImageRefCount() {
+        if (clone) { clone->ImageRefCount(true); }
+        for (auto &style : styles) {
+            if (style.image != nullptr) { style.image->trefc++; }
+        }
+    }
+};
+
+// Undo steps that no longer fit in the memory budget, compressed into a temporary file. They are
+// read back, newest first, once undo gets that far.
+struct UndoSpill {
+    struct Record {
+        wxFileOffset offset;
+        size_t size;
+        vector<Image *> images;  // what the step's image indices refer to
+    };
+    wxString filename;
+    wxFile file;
+    vector<Record> records;  // oldest first
+
+    ~UndoSpill() {
+        if (file.IsOpened()) { file.Close(); }
+        if (!filename.IsEmpty()) { ::wxRemoveFile(filename); }
+    }
+
+    void ImageRefCount() {
+        for (auto &record : records) {
+            for (auto *image : record.images) { image->trefc++; }
+        }
+    }
+
+    bool Write(const char *data, size_t size, vector<Image *> &&images) {
+        if (!file.IsOpened()) {
+            filename = wxFileName::CreateTempFileName("tsundo");
+            if (filename.IsEmpty() || !file.Open(filename, wxFile::read_write)) { return false; }
+        }
+        // Records are read back last to first, so the space of those already read is reused.
+        auto offset = records.empty() ? 0 : records.back().offset + records.back().size;
+        if (file.Seek(offset) == wxInvalidOffset || file.Write(data, size) != size) {
+            return false;
+        }
+        records.push_back({offset, size, std::move(images)});
+        return true;
+    }
+
+    bool Peek(size_t i, vector<char> &buffer) {
+        auto &record = records[i];
+        buffer.resize(record.size);
+        return file.Seek(record.offset) != wxInvalidOffset &&
+               file.Read(buffer.data(), record.size) == static_cast<ssize_t>(record.size);
+    }
+
+    bool Read(vector<char> &buffer, vector<Image *> &images) {
+        auto ok = Peek(records.size() - 1, buffer);
+        images = std::move(records.back().images);
+        records.pop_back();
+        return ok;
+    }
 };
 
 struct Document {
@@ -31,10 +158,28 @@ struct Document {
     Cell *currentdrawroot {nullptr};  // for use during Render() calls
     vector<unique_ptr<UndoItem>> undolist;
     vector<unique_ptr<UndoItem>> redolist;
+    UndoSpill undospill;
+
+    // The undo history as of the last save, kept next to the document if sys->undojournal is on.
+    // The file is appended to: new steps are added, and steps undone since the last save are
+    // dropped again with a pop record. Once those dead records outweigh the steps still held,
+    // it is written anew. See SyncJournal() and ReplayJournal().
+    struct UndoJournal {
+        wxString filename;
+        wxFile file;
+        long depth {0};     // steps the journal holds
+        long matching {0};  // how many of those are still at the bottom of the undo stack
+        std::map<std::tuple<uint64_t, char, double>, int> images;  // ids of the images written
+        int nextimage {0};        // ids of images only popped steps used are not reused
+        vector<size_t> stepsize;  // bytes of each step held, with the images first written for it
+        size_t dead {0};          // bytes of popped steps, pop records and old save markers
+        size_t marker {0};        // bytes of the last save marker, dead after the next sync
+    } journal;
     vector<Selection> drawpath;
     int pathscalebias {0};
     wxString filename {""};
     long lastmodsinceautosave {0};
+    long editcount {0};  // bumped by AddUndo/UndoEach, i.e. on every change to the tree
     long undolistsizeatfullsave {0};
     long lastsave {wxGetLocalTime()};
     bool modified {false};
@@ -78,9 +223,61 @@ struct Document {
     bool searchfilter {false};
     int editfilter {0};
     wxDateTime lastmodificationtime;
-    map<wxString, uint> tags;
+    std::unordered_map<wxString, uint, TextHash> tags;
+    long tagsversion {0};  // bumped when tags are added or removed, see Cell::TagColor()
     vector<Cell *> itercells;
 
+    // Cells by text and by image, for link jumps. Built on first use and kept current from then
+    // on: the cells an edit is about to change are taken out by AddUndo() and friends and put
+    // back on the next use, and undo does the same for the cells it swaps, see WillChange().
+    struct LinkIndexData {
+        bool built {false};
+        std::unordered_map<wxString, std::unordered_set<Cell *>, TextHash> bytext;
+        std::unordered_map<const Image *, std::unordered_set<Cell *>> byimage;
+    } linkindex;
+
+    // Cells and bytes in the whole document, for the status bar. Counted on first use and kept
+    // current the same way as the link index.
+    struct CountData {
+        bool built {false};
+        size_t bytes {0};
+        int cells {0};
+    } counts;
+
+    // Cells taken out of the link index and the counts by WillChange(), and whether their whole
+    // subtree was.
+    std::unordered_map<Cell *, bool> changing;
+
+    // Cells ordered by last edit time, for the edit filters. Rebuilt on first use after an edit
+    // that may have changed the shape of the tree. Typing into a cell only moves that cell to
+    // the back, see EditIndex().
+    struct EditIndexData {
+        long editcount {-1};
+        std::set<pair<int64_t, Cell *>> byedit;
+        std::unordered_map<const Cell *, int64_t> lastedit;
+        vector<Cell *> touched;
+    } editindex;
+
+    // Auto-exports are written on a worker thread, from a copy of the tree taken when it was
+    // saved. One runs at a time: saves made meanwhile replace the copy that is waiting, so only
+    // the latest of them is exported once the running one is done. See AutoExport().
+    struct AutoExportJob {
+        unique_ptr<Cell> root;
+        vector<unique_ptr<Image>> images;  // copies of the document's, for root's cells
+        std::unordered_map<wxString, uint, TextHash> tags;
+        wxString docname;
+        wxString filename;
+        int action;
+        ExportSettings settings;
+    };
+    struct AutoExportQueue {
+        std::mutex mutex;
+        unique_ptr<AutoExportJob> pending;
+        bool busy {false};
+        bool closed {false};  // the document is gone, so is its tab, and maybe the frame
+    };
+    shared_ptr<AutoExportQueue> autoexport {make_shared<AutoExportQueue>()};
+
     #define loopcellsin(par, c) \
         CollectCells(par);      \
         loopv(_i, itercells) for (auto c = itercells[_i]; c; c = nullptr)
@@ -100,6 +297,13 @@ struct Document {
         dndobjc->Add(dndobjf);
     }
 
+    // A running auto-export is left to finish on its own, the worker drops it when it's done.
+    ~Document() {
+        std::lock_guard lock(autoexport->mutex);
+        autoexport->pending.reset();
+        autoexport->closed = true;
+    }
+
     uint Background() const { return root ? root->cellcolor : 0xFFFFFF; }
 
     void InitCellSelect(Cell *initialselected, int xsize, int ysize) {
@@ -111,11 +315,14 @@ struct Document {
         if (selected.grid == nullptr) { return; }
         selected.xs = std::clamp(xsize, 1, selected.grid->xs - selected.x);
         selected.ys = std::clamp(ysize, 1, selected.grid->ys - selected.y);
-        sys->frame->UpdateStatus(selected, true);
+        sys->frame->UpdateStatus(this, selected, true);
     }
 
     void InitWith(unique_ptr<Cell> root, const wxString &filename, Cell *initialselected, int xsize, int ysize) {
         this->root = std::move(root);
+        linkindex = LinkIndexData();
+        counts = CountData();
+        changing.clear();
         InitCellSelect(initialselected, xsize, ysize);
         ChangeFileName(filename, false);
     }
@@ -167,7 +374,9 @@ struct Document {
 
             wxDataOutputStream sos(fos);
             fos.Write("TSFF", 4);
-            char vers = TS_VERSION;
+            // Older versions can still read a file that has no TS_BLANKS runs.
+            char vers = root->grid && root->grid->HasBlankRuns(ocs) ? TS_VERSION
+                                                                     : TS_VERSION_NO_BLANKS;
             fos.Write(&vers, 1);
             sos.Write8(selected.xs);
             sos.Write8(selected.ys);
@@ -190,7 +399,7 @@ struct Document {
             if (!zos.IsOk()) { return _("Zlib error while writing file."); }
             wxDataOutputStream dos(zos);
             root->Save(dos, ocs);
-            for (auto &[tag, color] : tags) {
+            for (auto &[tag, color] : SortedTags()) {
                 dos.WriteString(tag);
                 dos.Write32(color);
             }
@@ -212,6 +421,7 @@ struct Document {
 
         if (!istempfile) {
             undolistsizeatfullsave = undolist.size();
+            SyncJournal();
             modified = false;
             tmpsavesuccess = true;
             sys->FileUsed(filename, this);
@@ -220,11 +430,10 @@ struct Document {
             }
         }
         if (sys->autohtmlexport != 0) {
-            ExportFile(treesheets::System::ExtName(filename, ".html"),
+            AutoExport(treesheets::System::ExtName(filename, ".html"),
                        sys->autohtmlexport == A_AUTOEXPORT_HTML_WITH_IMAGES - A_AUTOEXPORT_HTML_NONE
                            ? A_EXPHTMLTE
-                           : A_EXPHTMLT,
-                       false);
+                           : A_EXPHTMLT);
         }
         #ifdef ENABLE_WXPDFDOC
             if (sys->autopdfexport) {
@@ -310,7 +519,7 @@ struct Document {
     }
 
     void ZoomTiny() {
-        if (auto *c = selected.GetCell(); c != nullptr && c->tiny) {
+        if (auto *c = selected.GetCell(); c != nullptr && c->L().tiny) {
             Zoom(1);  // seems to leave selection box in a weird location?
             if (selected.GetCell() != c) { ZoomTiny(); }
         }
@@ -370,12 +579,17 @@ struct Document {
         }
     }
 
-    auto CopyEntireCells(wxString &s, int action) {
-        sys->clipboardcopy = s;
-        auto html =
-            selected.grid->ConvertToText(selected, 0, action == A_COPYWI ? A_EXPHTMLTI : A_EXPHTMLT,
-                                         this, false, currentdrawroot);
-        return new wxHTMLDataObject(html);
+    // Only clones the selection: text and HTML are rendered from the clone on demand.
+    shared_ptr<ClipboardSnapshot> CopyCells(int action) {
+        sys->cellclipboard = selected.grid->CloneSel(selected);
+        sys->cellclipboardsingle = selected.GetCell() != nullptr;
+        // The clone's grid stands in for the selected one, whose border width the HTML uses.
+        sys->cellclipboard->grid->user_grid_outer_spacing =
+            selected.grid->cell == root.get() ? g_usergridouterspacing_default
+                                              : selected.grid->user_grid_outer_spacing;
+        return make_shared<ClipboardSnapshot>(sys->cellclipboard, selected,
+                                              action == A_COPYWI ? A_EXPHTMLTI : A_EXPHTMLT,
+                                              tags);
     }
 
     void Copy(int action) {
@@ -385,10 +599,9 @@ struct Document {
 
         switch (action) {
             case A_DRAGANDDROP: {
-                sys->cellclipboard =
-                    c != nullptr ? c->Clone(nullptr) : selected.grid->CloneSel(selected);
+                auto snapshot = CopyCells(wxID_COPY);
                 wxDataObjectComposite dragdata;
-                if (c != nullptr && !c->text.t && c->text.image != nullptr) {
+                if (c != nullptr && c->text.t.IsEmpty() && c->text.image != nullptr) {
                     auto *image = c->text.image;
                     if (!image->data.empty()) {
                         auto &it = imagetypes.at(image->type).first;
@@ -396,12 +609,9 @@ struct Document {
                         dragdata.Add(new wxBitmapDataObject(bitmap));
                     }
                 } else {
-                    auto s = selected.grid->ConvertToText(selected, 0, A_EXPTEXT, this, false,
-                                                          currentdrawroot);
-                    dragdata.Add(new wxTextDataObject(s));
+                    dragdata.Add(new ClipboardTextDataObject(snapshot));
                     if (!selected.TextEdit()) {
-                        auto *htmlobj = CopyEntireCells(s, wxID_COPY);
-                        dragdata.Add(htmlobj);
+                        dragdata.Add(new ClipboardHTMLDataObject(snapshot));
                     }
                 }
                 wxDropSource dragsource(dragdata, canvas);
@@ -412,7 +622,7 @@ struct Document {
                 sys->cellclipboard = nullptr;
                 auto clipboardtextdata = make_unique<wxDataObjectComposite>();
                 wxString s = "";
-                loopallcellssel(c, true) if (!c->text.t.IsEmpty()) { s += c->text.t + " "; }
+                loopallcellssel(c, true) if (!c->text.t.IsEmpty()) { s += c->text.t.Get() + " "; }
                 if (!selected.TextEdit()) { sys->clipboardcopy = s; }
                 clipboardtextdata->Add(new wxTextDataObject(s));
                 if (wxTheClipboard->Open()) {
@@ -424,17 +634,13 @@ struct Document {
             case wxID_COPY:
             case A_COPYWI:
             default: {
-                sys->cellclipboard =
-                    c != nullptr ? c->Clone(nullptr) : selected.grid->CloneSel(selected);
+                auto snapshot = CopyCells(action);
                 auto clipboarddata = make_unique<wxDataObjectComposite>();
-                auto s = selected.grid->ConvertToText(selected, 0, A_EXPTEXT, this, false,
-                                                      currentdrawroot);
-                clipboarddata->Add(new wxTextDataObject(s));
+                clipboarddata->Add(new ClipboardTextDataObject(snapshot));
                 if (!selected.TextEdit()) {
-                    auto *htmlobj = CopyEntireCells(s, action);
-                    clipboarddata->Add(htmlobj);
+                    clipboarddata->Add(new ClipboardHTMLDataObject(snapshot));
                 }
-                if (c != nullptr && !c->text.t && c->text.image != nullptr) {
+                if (c != nullptr && c->text.t.IsEmpty() && c->text.image != nullptr) {
                     auto *image = c->text.image;
                     auto &it = imagetypes.at(image->type).first;
                     auto bitmap = ConvertBufferToWxBitmap(image->data, it);
@@ -502,13 +708,13 @@ struct Document {
                 UpdateLayout();
                 ScrollIfSelectionOutOfView();
                 canvas->Refresh();
-                sys->frame->UpdateStatus(selected, false);
+                sys->frame->UpdateStatus(this, selected, false);
                 return dir > 0 ? _("Column width increased.") : _("Column width decreased.");
             }
             return _("nothing to resize");
         } else if (shift) {
             if (selected.grid == nullptr) { return NoSel(); }
-            selected.grid->cell->AddUndo(this);
+            AddStyleUndo(selected, true);
             selected.grid->ResetChildren();
             selected.grid->RelSize(-dir, selected, pathscalebias);
             UpdateLayout();
@@ -542,8 +748,8 @@ struct Document {
             if (!p->text.t.IsEmpty()) { hierarchysize += dc.GetCharHeight(); }
         }
         hierarchysize += fgutter;
-        layoutxs = currentdrawroot->sx + hierarchysize + fgutter;
-        layoutys = currentdrawroot->sy + hierarchysize + fgutter;
+        layoutxs = currentdrawroot->L().sx + hierarchysize + fgutter;
+        layoutys = currentdrawroot->L().sy + hierarchysize + fgutter;
     }
 
     template<typename DC> void ShiftToCenter(DC &dc) const {
@@ -560,7 +766,7 @@ struct Document {
         for (auto *p = currentdrawroot->parent; p != nullptr; p = p->parent) {
             if (!p->text.t.IsEmpty()) {
                 int off = hierarchysize - dc.GetCharHeight() * ++i;
-                auto s = p->text.t;
+                auto s = p->text.t.Get();
                 if (static_cast<int>(s.Len()) > sys->defaultmaxcolwidth) {
                     // should take the width of these into account for layoutys, but really, the
                     // worst that can happen on a thin window is that its rendering gets cut off
@@ -866,57 +1072,154 @@ struct Document {
             }
         #endif
         else {
-            wxFFileOutputStream fos(filename, "w+b");
-            if (!fos.IsOk()) {
+            auto error = ExportText(filename, action, exportroot, this, this->filename,
+                                    root->cellcolor, CurrentExportSettings());
+            if (!error.IsEmpty()) {
                 wxMessageBox(_("Error exporting file!"), filename.wx_str(), wxOK, sys->frame);
-                return _("Error writing to file!");
-            }
-            wxTextOutputStream dos(fos);
-            wxString content = exportroot->ToText(0, Selection(), action, this, true, exportroot);
-            switch (action) {
-                case A_EXPXML:
-                    dos.WriteString(
-                        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-                        "<!DOCTYPE cell [\n"
-                        "<!ELEMENT cell (grid)>\n"
-                        "<!ELEMENT grid (row*)>\n"
-                        "<!ELEMENT row (cell*)>\n"
-                        "]>\n");
-                    dos.WriteString(content);
-                    break;
-                case A_EXPHTMLT:
-                case A_EXPHTMLTI:
-                case A_EXPHTMLTE:
-                case A_EXPHTMLB:
-                case A_EXPHTMLO: {
-                    wxString output;
-                    output
-                        << "<!DOCTYPE html>\n"
-                        << "<html>\n<head>\n<style>\n"
-                        << "body { font-family: '" << sys->defaultfont << "', sans-serif; }\n"
-                        << "table, th, td { border: 1px solid #A0A0A0; border-collapse: collapse;"
-                        << " padding: 3px; vertical-align: top; }\n"
-                        << "@media (prefers-color-scheme: dark) {\n"
-                        << "  html { filter: invert(1); }\n"
-                        << "  img { filter: invert(1); }\n"
-                        << "}\n"
-                        << "li { }\n</style>\n"
-                        << "<title>export of TreeSheets file " << this->filename
-                        << "</title>\n<meta charset=\"UTF-8\" />\n"
-                        << "</head>\n<body style=\""
-                        << wxString::Format("background-color: #%06X;", SwapColor(root->cellcolor))
-                        << "\">" << content << "</body>\n</html>\n";
-                    dos.WriteString(output);
-                    break;
-                }
-                case A_EXPCSV:
-                case A_EXPTEXT: dos.WriteString(content); break;
+                return error;
             }
-            if (action == A_EXPHTMLTE) { ExportAllImages(filename, exportroot); }
         }
         return _("File exported successfully.");
     }
 
+    void AutoExport(const wxString &exportname, int action) {
+        auto job = make_unique<AutoExportJob>();
+        job->root = root->Clone(nullptr);
+        // Like a copy to the clipboard, the copy's grid stands in for the root one in the HTML.
+        if (job->root->grid) {
+            job->root->grid->user_grid_outer_spacing = g_usergridouterspacing_default;
+        }
+        // The document's images may be rescaled, replaced or purged while the worker runs, so
+        // the copy gets images of its own. Only an export with images needs their data.
+        std::unordered_map<Image *, Image *> copies;
+        vector<Cell *> cells;
+        job->root->CollectCells(cells);
+        for (auto *c : cells) {
+            auto *&image = c->text.image;
+            if (image == nullptr) { continue; }
+            auto &copy = copies[image];
+            if (copy == nullptr) {
+                auto data = action == A_EXPHTMLTE ? image->data : vector<uint8_t>();
+                job->images.push_back(make_unique<Image>(image->hash, image->display_scale,
+                                                         std::move(data), image->type));
+                copy = job->images.back().get();
+            }
+            image = copy;
+        }
+        job->tags = tags;
+        job->root->ResolveTags(job->tags);
+        job->docname = filename;
+        job->filename = exportname;
+        job->action = action;
+        job->settings = CurrentExportSettings();
+        unique_ptr<AutoExportJob> replaced;  // freed once the lock is released
+        std::lock_guard lock(autoexport->mutex);
+        replaced = std::move(autoexport->pending);
+        autoexport->pending = std::move(job);
+        if (!autoexport->busy) {
+            autoexport->busy = true;
+            // Workers are only waited for on exit, by ~System().
+            auto &workers = sys->autoexportworkers;
+            std::erase_if(workers, [](const std::future<void> &w) {
+                return w.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            });
+            workers.push_back(
+                std::async(std::launch::async, &Document::AutoExportWorker, autoexport));
+        }
+    }
+
+    // Runs on a worker thread: must only touch the jobs in q, which own everything they export.
+    // The cells of a job go back to the pools of the UI thread when the job is freed here.
+    static void AutoExportWorker(shared_ptr<AutoExportQueue> q) {
+        for (;;) {
+            unique_ptr<AutoExportJob> job;
+            {
+                std::lock_guard lock(q->mutex);
+                if (!q->pending || q->closed) {
+                    q->busy = false;
+                    return;
+                }
+                job = std::move(q->pending);
+            }
+            auto error = ExportText(job->filename, job->action, job->root.get(), nullptr,
+                                    job->docname, job->root->cellcolor, job->settings);
+            auto filename = job->filename;
+            job.reset();
+            // The frame outlives the document, which closes the queue under this lock.
+            std::lock_guard lock(q->mutex);
+            if (q->closed) { continue; }
+            sys->frame->CallAfter([filename, error]() {
+                sys->frame->SetStatus(
+                    error.IsEmpty()
+                        ? wxString::Format(_("Exported %s."), filename)
+                        : wxString::Format(_("Error exporting %s: %s"), filename, error));
+            });
+        }
+    }
+
+    static ExportSettings CurrentExportSettings() {
+        return {sys->defaultfont, sys->defaultfixedfont, sys->frame->FromDIP(1.0)};
+    }
+
+    // The text based formats. Touches no UI and, given a doc of nullptr, nothing of any document
+    // either, so auto-exports can run it on a worker thread. Returns an error, or empty.
+    static wxString ExportText(const wxString &filename, int action, Cell *exportroot,
+                               Document *doc, const wxString &docname, uint background,
+                               const ExportSettings &settings) {
+        wxFFileOutputStream fos(filename, "w+b");
+        if (!fos.IsOk()) { return _("Error writing to file!"); }
+        wxTextOutputStream dos(fos);
+        TextWriter w(&dos, settings);
+        switch (action) {
+            case A_EXPXML:
+                dos.WriteString(
+                    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<!DOCTYPE cell [\n"
+                    "<!ELEMENT cell (grid)>\n"
+                    "<!ELEMENT grid (row*)>\n"
+                    "<!ELEMENT row (cell*)>\n"
+                    "]>\n");
+                exportroot->ToText(w, 0, Selection(), action, doc, true, exportroot);
+                w.Flush();
+                break;
+            case A_EXPHTMLT:
+            case A_EXPHTMLTI:
+            case A_EXPHTMLTE:
+            case A_EXPHTMLB:
+            case A_EXPHTMLO: {
+                w.text
+                    << "<!DOCTYPE html>\n"
+                    << "<html>\n<head>\n<style>\n"
+                    << "body { font-family: '" << settings.font << "', sans-serif; }\n"
+                    << "table, th, td { border: 1px solid #A0A0A0; border-collapse: collapse;"
+                    << " padding: 3px; vertical-align: top; }\n"
+                    << "@media (prefers-color-scheme: dark) {\n"
+                    << "  html { filter: invert(1); }\n"
+                    << "  img { filter: invert(1); }\n"
+                    << "}\n"
+                    << "li { }\n</style>\n"
+                    << "<title>export of TreeSheets file " << docname
+                    << "</title>\n<meta charset=\"UTF-8\" />\n"
+                    << "</head>\n<body style=\""
+                    << wxString::Format("background-color: #%06X;", SwapColor(background))
+                    << "\">";
+                exportroot->ToText(w, 0, Selection(), action, doc, true, exportroot);
+                w.text << "</body>\n</html>\n";
+                w.Flush();
+                break;
+            }
+            case A_EXPCSV:
+            case A_EXPTEXT:
+                exportroot->ToText(w, 0, Selection(), action, doc, true, exportroot);
+                w.Flush();
+                break;
+        }
+        if (action == A_EXPHTMLTE && !ExportAllImages(filename, exportroot)) {
+            return _("Error writing image file!");
+        }
+        return wxEmptyString;
+    }
+
     wxString Save(bool saveas, bool *success = nullptr) {
         if (!saveas && !filename.empty()) { return SaveDB(success); }
         auto filename = ::wxFileSelector(_("Choose TreeSheets file to save:"), "", "", "cts",
@@ -1010,8 +1313,7 @@ struct Document {
                 selected.Wrap(this);
                 c = selected.GetCell();
             }
-            c->AddUndo(this);  // FIXME: not needed for all keystrokes, or at least, merge all
-                               // keystroke undos within same cell
+            AddTextUndo(c);
             c->text.Key(this, uk, selected);
             UpdateLayout();
             ScrollIfSelectionOutOfView();
@@ -1047,7 +1349,7 @@ struct Document {
             }
 
             case wxID_UNDO:
-                if (!undolist.empty()) {
+                if (!undolist.empty() || UnspillUndo()) {
                     Undo(undolist, redolist);
                     return wxEmptyString;
                 } else {
@@ -1113,6 +1415,15 @@ struct Document {
                 return message;
             }
 
+            case A_FINDINFILES: {
+                auto directory =
+                    wxDirSelector(_("Please select a folder to search in:"), wxEmptyString,
+                                  wxDD_DEFAULT_STYLE | wxDD_DIR_MUST_EXIST, wxDefaultPosition,
+                                  sys->frame);
+                if (directory.IsEmpty()) { return _("Find in files cancelled."); }
+                return sys->FindInFiles(directory);
+            }
+
             case wxID_CLOSE: {
                 if (sys->frame->notebook->GetPageCount() <= 1) {
                     sys->frame->fromclosebox = false;
@@ -1336,13 +1647,22 @@ struct Document {
                 }
             }
 
-            case A_CASESENSITIVESEARCH: {
-                sys->casesensitivesearch = !(sys->casesensitivesearch);
-                sys->cfg->Write("casesensitivesearch", sys->casesensitivesearch);
-                sys->searchstring = (sys->casesensitivesearch)
-                                        ? sys->frame->filter->GetValue()
-                                        : sys->frame->filter->GetValue().Lower();
-                auto message = SearchNext(false, false, false);
+            case A_CASESENSITIVESEARCH:
+            case A_SEARCHPLAIN:
+            case A_SEARCHWHOLEWORD:
+            case A_SEARCHREGEX:
+            case A_SEARCHFUZZY: {
+                if (action == A_CASESENSITIVESEARCH) {
+                    sys->casesensitivesearch = !(sys->casesensitivesearch);
+                    sys->cfg->Write("casesensitivesearch", sys->casesensitivesearch);
+                } else {
+                    sys->searchmode = action - A_SEARCHPLAIN;
+                    sys->cfg->Write("searchmode", static_cast<long>(sys->searchmode));
+                }
+                auto message = sys->SetSearch(sys->searchstring);
+                if (searchfilter) { SetSearchFilter(!sys->searchmatcher.IsEmpty()); }
+                sys->frame->searchresults->Start(this);
+                if (message.IsEmpty()) { message = SearchNext(false, false, false); }
                 canvas->Refresh();
                 return message;
             }
@@ -1382,19 +1702,17 @@ struct Document {
             case A_REPLACEONCE:
             case A_REPLACEONCEJ:
             case A_REPLACEALL: {
-                if (sys->searchstring.IsEmpty()) { return _("No search."); }
+                if (sys->searchmatcher.IsEmpty()) { return _("No search."); }
                 auto replaces = sys->frame->replaces->GetValue();
-                auto lreplaces =
-                    sys->casesensitivesearch ? wxString(wxEmptyString) : replaces.Lower();
                 if (action == A_REPLACEALL) {
                     root->AddUndo(this);  // expensive?
-                    root->FindReplaceAll(replaces, lreplaces);
+                    root->FindReplaceAll(replaces);
                     root->ResetChildren();
                     UpdateLayout();
                     canvas->Refresh();
                 } else {
                     if (selected.grid == nullptr) { return NoSel(); }
-                    selected.grid->ReplaceStr(this, replaces, lreplaces, selected);
+                    selected.grid->ReplaceStr(this, replaces, selected);
                     if (action == A_REPLACEONCEJ) { return SearchNext(false, true, false); }
                 }
                 return _("Text has been replaced.");
@@ -1533,7 +1851,7 @@ struct Document {
                     }
                 } else if (cell != nullptr && selected.TextEdit()) {
                     if (selected.cursorend == 0) { return wxEmptyString; }
-                    cell->AddUndo(this);
+                    AddTextUndo(cell);
                     cell->text.Backspace(selected);
                     UpdateLayout();
                     canvas->Refresh();
@@ -1555,7 +1873,7 @@ struct Document {
                     }
                 } else if (cell != nullptr && selected.TextEdit()) {
                     if (selected.cursor == cell->text.t.Len()) { return wxEmptyString; }
-                    cell->AddUndo(this);
+                    AddTextUndo(cell);
                     cell->text.Delete(selected);
                     UpdateLayout();
                     canvas->Refresh();
@@ -1569,7 +1887,7 @@ struct Document {
             case A_DELETE_WORD:
                 if (cell != nullptr && selected.TextEdit()) {
                     if (selected.cursor == cell->text.t.Len()) { return wxEmptyString; }
-                    cell->AddUndo(this);
+                    AddTextUndo(cell);
                     cell->text.DeleteWord(selected);
                     UpdateLayout();
                     canvas->Refresh();
@@ -1593,7 +1911,7 @@ struct Document {
                         selected.grid->MultiCellDelete(this, selected);
                         SetSelect(selected);
                     } else if (cell != nullptr) {
-                        cell->AddUndo(this);
+                        AddTextUndo(cell);
                         cell->text.Backspace(selected);
                     }
                     UpdateLayout();
@@ -1619,13 +1937,13 @@ struct Document {
                 auto *fc = selected.GetFirst();
                 wxString ct = "";
                 loopallcellssel(ci, true) if (ci != fc && !ci->text.t.IsEmpty()) {
-                    ct += " " + ci->text.t;
+                    ct += " " + ci->text.t.Get();
                 }
                 if (!fc->HasContent() && ct.IsEmpty()) {
                     return _("There is no content to collapse.");
                 }
                 fc->parent->AddUndo(this);
-                fc->text.t += ct;
+                fc->text.t.Append(ct);
                 loopallcellssel(ci, false) if (ci != fc) { ci->Clear(); }
                 Selection deletesel(
                     selected.grid,
@@ -1644,7 +1962,7 @@ struct Document {
             case wxID_SELECTALL:
                 selected.SelAll();
                 canvas->Refresh();
-                sys->frame->UpdateStatus(selected, true);
+                sys->frame->UpdateStatus(this, selected, true);
                 return wxEmptyString;
 
             case A_UP:
@@ -1690,7 +2008,7 @@ struct Document {
                         ext = gridmax - pos;
                     }
 
-                    sys->frame->UpdateStatus(selected, true);
+                    sys->frame->UpdateStatus(this, selected, true);
                     canvas->Refresh();
                 } else if (action == A_SCLEFT || action == A_SCRIGHT) {
                     selected.Cursor(this, action - A_SCUP + A_UP, true, true);
@@ -1726,7 +2044,7 @@ struct Document {
                     case A_MARKVIEWV: newcelltype = CT_VIEWV; break;
                     case A_MARKCODE: newcelltype = CT_CODE; break;
                 }
-                selected.grid->cell->AddUndo(this);
+                AddStyleUndo(selected);
                 loopallcellssel(c, false) {
                     c->celltype = (newcelltype == CT_CODE) ? sys->evaluator.InferCellType(c->text)
                                                            : newcelltype;
@@ -1793,7 +2111,7 @@ struct Document {
                     ScrollIfSelectionOutOfView();
                     canvas->Refresh();
                 } else if (sys->cellclipboard) {
-                    cell->Paste(this, sys->cellclipboard.get(), selected);
+                    cell->Paste(this, sys->ClipboardCell(), selected);
                     UpdateLayout();
                     ScrollIfSelectionOutOfView();
                     canvas->Refresh();
@@ -1818,7 +2136,7 @@ struct Document {
                 text.SetFocus();
 
                 if (dlg.ShowModal() == wxID_OK) {
-                    if (cell->note != text.GetValue()) {
+                    if (cell->note.Get() != text.GetValue()) {
                         cell->AddUndo(this);
                         cell->note = text.GetValue();
                         UpdateLayout();
@@ -1832,8 +2150,8 @@ struct Document {
 
             case A_PASTESTYLE:
                 if (!sys->cellclipboard) { return _("No style to paste."); }
-                selected.grid->cell->AddUndo(this);
-                selected.grid->SetStyles(selected, sys->cellclipboard.get());
+                AddStyleUndo(selected);
+                selected.grid->SetStyles(selected, sys->ClipboardCell());
                 selected.grid->cell->ResetChildren();
                 UpdateLayout();
                 canvas->Refresh();
@@ -1875,7 +2193,7 @@ struct Document {
             }
 
             case A_IMAGER: {
-                selected.grid->cell->AddUndo(this);
+                AddStyleUndo(selected);
                 selected.grid->ClearImages(selected);
                 selected.grid->cell->ResetChildren();
                 UpdateLayout();
@@ -1904,7 +2222,7 @@ struct Document {
             case A_BORD3:
             case A_BORD4:
             case A_BORD5:
-                selected.grid->cell->AddUndo(this);
+                AddStyleUndo(selected);
                 selected.grid->SetBorder(action - A_BORD0 + 1);
                 selected.grid->cell->ResetChildren();
                 UpdateLayout();
@@ -1933,7 +2251,7 @@ struct Document {
             case A_LASTTEXTCOLOR:
             case A_LASTBORDCOLOR:
             case A_LASTIMAGE:
-                selected.grid->cell->AddUndo(this);
+                AddStyleUndo(selected, true);
                 loopallcellssel(c, true) switch (action) {
                     case A_RESETSIZE: c->text.relsize = 0; break;
                     case A_RESETWIDTH:
@@ -1944,8 +2262,8 @@ struct Document {
                         break;
                     case A_RESETSTYLE: c->text.stylebits = 0; break;
                     case A_RESETCOLOR:
-                        if (c->IsTag(this)) {
-                            tags[c->text.t] = g_tagcolor_default;
+                        if (auto tagcolor = c->TagColor(this)) {
+                            *tagcolor = g_tagcolor_default;
                         } else {
                             c->textcolor = g_textcolor_default;
                         }
@@ -1966,7 +2284,7 @@ struct Document {
                 selected.grid->cell->ResetChildren();
                 UpdateLayout();
                 canvas->Refresh();
-                sys->frame->UpdateStatus(selected, false);
+                sys->frame->UpdateStatus(this, selected, false);
                 return wxEmptyString;
 
             case A_MINISIZE: {
@@ -2139,14 +2457,14 @@ struct Document {
             case A_TAGADD: {
                 loopallcellssel(c, false) {
                     if (c->text.t.IsEmpty()) { continue; }
-                    tags[c->text.t] = g_tagcolor_default;
+                    AddTag(c->text.t.Get(), g_tagcolor_default);
                 }
                 canvas->Refresh();
                 return wxEmptyString;
             }
 
             case A_TAGREMOVE: {
-                loopallcellssel(c, false) tags.erase(c->text.t);
+                loopallcellssel(c, false) RemoveTag(c->text.t.Get());
                 canvas->Refresh();
                 return wxEmptyString;
             }
@@ -2178,7 +2496,7 @@ struct Document {
                             "Selected grid is not a table: cells must not already have sub-grids.");
                     }
                     ac->AddUndo(this);
-                    ac->grid->Hierarchify(this);
+                    ac->grid->Hierarchify();
                     ac->ResetChildren();
                     selected = Selection();
                     begindrag = Selection();
@@ -2192,7 +2510,7 @@ struct Document {
                     int maxdepth = 0;
                     int leaves = 0;
                     ac->MaxDepthLeaves(0, maxdepth, leaves);
-                    auto g = make_shared<Grid>(maxdepth, leaves);
+                    auto g = make_pooled<Grid>(maxdepth, leaves);
                     g->InitCells();
                     ac->grid->Flatten(0, 0, g.get());
                     ac->grid = g;
@@ -2224,11 +2542,8 @@ struct Document {
                     cell->text.image == nullptr) {
                     return _("No image in this cell.");
                 }
-                bool t1 = false;
-                bool t2 = false;
-                auto *link = root->FindLink(selected, cell, nullptr, t1, t2,
-                                            action == A_LINK || action == A_LINKIMG,
-                                            action == A_LINKIMG || action == A_LINKIMGREV);
+                auto *link = FindLink(cell, selected, action == A_LINK || action == A_LINKIMG,
+                                      action == A_LINKIMG || action == A_LINKIMGREV);
                 if (link == nullptr || link->parent == nullptr) {
                     return _("No matching cell found!");
                 }
@@ -2249,7 +2564,7 @@ struct Document {
                     return _("Can only move this cell from a Nx1 or 1xN grid.");
                 }
                 pp->AddUndo(this);
-                SetSelect(pp->grid->HierarchySwap(cell->text.t));
+                SetSelect(pp->grid->HierarchySwap(cell->text.t.Get()));
                 pp->ResetChildren();
                 pp->ResetLayout();
                 UpdateLayout();
@@ -2292,7 +2607,7 @@ struct Document {
 
         switch (action) {
             case A_CANCELEDIT:
-                if (LastUndoSameCellTextEdit(cell)) {
+                if (LastUndoSameCellTextEdit(cell, true)) {
                     Undo(undolist, redolist);
                 } else {
                     UpdateLayout();
@@ -2303,7 +2618,7 @@ struct Document {
 
             case A_BACKSPACE_WORD:
                 if (selected.cursorend == 0) { return wxEmptyString; }
-                cell->AddUndo(this);
+                AddTextUndo(cell);
                 cell->text.BackspaceWord(selected);
                 UpdateLayout();
                 canvas->Refresh();
@@ -2340,8 +2655,9 @@ struct Document {
             return wxEmptyString;  // fix crash when opening new doc
         }
         if (sys->searchstring.IsEmpty()) { return _("No search string."); }
+        if (sys->searchmatcher.IsEmpty()) { return _("Invalid search."); }
         bool lastsel = true;
-        Cell *next = root->FindNextSearchMatch(sys->searchstring, nullptr, selected.GetCell(),
+        Cell *next = root->FindNextSearchMatch(sys->searchmatcher, nullptr, selected.GetCell(),
                                                lastsel, reverse);
         if (next == nullptr || next->parent == nullptr) { return _("No matches for search."); }
         if (!jump) { return wxEmptyString; }
@@ -2353,7 +2669,7 @@ struct Document {
 
     wxString layrender(int ds, bool vert, bool toggle = false, bool noset = false) {
         if (selected.Thin()) { return NoThin(); }
-        selected.grid->cell->AddUndo(this);
+        AddStyleUndo(selected, true);
         bool v = toggle ? !selected.GetFirst()->verticaltextandgrid : vert;
         if (ds >= 0 && selected.IsAll()) { selected.grid->cell->drawstyle = ds; }
         selected.grid->SetGridTextLayout(ds, v, noset, selected);
@@ -2410,19 +2726,24 @@ struct Document {
             Cell *cell = selected.ThinExpand(this);
             auto text = textdataobject.GetText();
             if ((sys->clipboardcopy == text) && sys->cellclipboard) {
-                cell->Paste(this, sys->cellclipboard.get(), selected);
+                cell->Paste(this, sys->ClipboardCell(), selected);
             } else {
-                const wxArrayString &lines = wxStringTokenize(text, LINE_DELIMITERS);
-                if (lines.size() == 1) {
-                    cell->AddUndo(this);
-                    cell->ResetLayout();
-                    PasteSingleText(cell, lines[0]);
-                } else if (lines.size() > 1) {
+                // Only whether there is more than one line matters, so counting stops at two.
+                int lines = 0;
+                wxString line;
+                treesheets::System::ForEachLine(text, [&](auto begin, auto end) {
+                    if (lines++ == 0) { line = wxString(begin, end); }
+                    return lines < 2;
+                });
+                if (lines == 1) {
+                    AddTextUndo(cell);
+                    PasteSingleText(cell, line);
+                } else if (lines > 1) {
                     cell->parent->AddUndo(this);
                     cell->ResetLayout();
                     cell->grid = nullptr;
-                    sys->FillRows(cell->AddGrid(), lines, treesheets::System::CountCol(lines[0]), 0,
-                                  0);
+                    treesheets::System::FillIndented(
+                        text, [&](int rows) { return cell->AddGrid(1, rows); });
                     if (!cell->HasText()) {
                         cell->grid->MergeWithParent(cell->parent->grid, selected, this);
                     }
@@ -2482,6 +2803,176 @@ struct Document {
         }
     }
 
+    void IndexLink(Cell *c, bool add) {
+        auto &index = linkindex;
+        if (!c->text.t.IsEmpty()) {
+            if (add) {
+                index.bytext[c->text.t.Get()].insert(c);
+            } else if (auto it = index.bytext.find(c->text.t.Get()); it != index.bytext.end()) {
+                it->second.erase(c);
+                if (it->second.empty()) { index.bytext.erase(it); }
+            }
+        }
+        if (c->text.image != nullptr) {
+            if (add) {
+                index.byimage[c->text.image].insert(c);
+            } else if (auto it = index.byimage.find(c->text.image); it != index.byimage.end()) {
+                it->second.erase(c);
+                if (it->second.empty()) { index.byimage.erase(it); }
+            }
+        }
+    }
+
+    void IndexLinks(Cell *c, bool add) {
+        IndexLink(c, add);
+        if (c->grid) {
+            for (auto &child : c->grid->cells) {
+                if (child) { IndexLinks(child.get(), add); }
+            }
+        }
+    }
+
+    void CountCells(Cell *c, bool subtree, bool add) {
+        size_t bytes = 0;
+        int cells = 0;
+        if (subtree) {
+            c->Count(bytes, cells);
+        } else {
+            bytes = sizeof(Cell) + c->text.EstimatedMemoryUse();
+        }
+        if (add) {
+            counts.bytes += bytes;
+            counts.cells += cells;
+        } else {
+            counts.bytes -= bytes;
+            counts.cells -= cells;
+        }
+    }
+
+    void TrackChange(Cell *c, bool subtree, bool add) {
+        if (linkindex.built) {
+            if (subtree) {
+                IndexLinks(c, add);
+            } else {
+                IndexLink(c, add);
+            }
+        }
+        if (counts.built) { CountCells(c, subtree, add); }
+    }
+
+    // Called before c (and everything below it, if subtree) changes. Its cells leave the link
+    // index and the counts while they still are what those were made from, and come back on
+    // the next use of either, see FlushChanges().
+    void WillChange(Cell *c, bool subtree) {
+        if (!linkindex.built && !counts.built) { return; }
+        // Nothing to do if c is out already, by itself or with a parent, e.g. when typing.
+        for (auto *p = c; p != nullptr; p = p->parent) {
+            auto it = changing.find(p);
+            if (it != changing.end() && (it->second || (p == c && !subtree))) { return; }
+        }
+        // Only c itself was out so far.
+        if (changing.erase(c) != 0) { TrackChange(c, false, true); }
+        TrackChange(c, subtree, false);
+        changing[c] = subtree;
+    }
+
+    // The cells whose style (which includes the image) is recorded by AddStyleUndo().
+    void WillChangeStyles(Cell *c, const Selection &s, bool recursive) {
+        WillChange(c, false);
+        for (int y = s.y; y < s.y + s.ys; y++) {
+            for (int x = s.x; x < s.x + s.xs; x++) {
+                WillChange(c->grid->C(x, y).get(), recursive);
+            }
+        }
+    }
+
+    void FlushChanges() {
+        for (auto [c, subtree] : changing) { TrackChange(c, subtree, true); }
+        changing.clear();
+    }
+
+    // Both of these flush first, so that what was taken out of the other one before this one
+    // was built goes back only there.
+    LinkIndexData &LinkIndex() {
+        FlushChanges();
+        if (!linkindex.built) {
+            linkindex = LinkIndexData();
+            linkindex.built = true;
+            IndexLinks(root.get(), true);
+        }
+        return linkindex;
+    }
+
+    CountData &Counts() {
+        FlushChanges();
+        if (!counts.built) {
+            counts = CountData();
+            counts.built = true;
+            root->Count(counts.bytes, counts.cells);
+        }
+        return counts;
+    }
+
+    // Positions of c and its parents in their grids, from the top down.
+    static void CreateSlotPath(Cell *c, vector<int> &path) {
+        path.clear();
+        for (; c->parent != nullptr; c = c->parent) {
+            c->parent->grid->FindCell(c);  // makes sure the slot is current
+            path.push_back(c->slot);
+        }
+        ranges::reverse(path);
+    }
+
+    // Whether a comes before b in the order a link jump visits cells: children before their
+    // parent, and siblings in grid order, or the reverse of it when going backward.
+    static bool LinkOrderBefore(const vector<int> &a, const vector<int> &b, bool forward) {
+        auto [ia, ib] = ranges::mismatch(a, b);
+        if (ia == a.end() || ib == b.end()) { return a.size() > b.size(); }
+        return forward ? *ia < *ib : *ia > *ib;
+    }
+
+    // Finds the next (or previous) cell with the same text or image as link. Cells that differ
+    // in style from link are preferred, as those are more likely to be a definition rather than
+    // another reference.
+    Cell *FindLink(Cell *link, const Selection &sel, bool forward, bool image) {
+        auto &index = LinkIndex();
+        const std::unordered_set<Cell *> *found = nullptr;
+        if (image) {
+            if (auto it = index.byimage.find(link->text.image); it != index.byimage.end()) {
+                found = &it->second;
+            }
+        } else {
+            auto key = link->text.ToText(0, sel, A_EXPTEXT);
+            if (auto it = index.bytext.find(key); it != index.bytext.end()) {
+                found = &it->second;
+            }
+        }
+        if (found == nullptr) { return nullptr; }
+        // The first candidate after link wins, else the first one overall (wrapping around),
+        // with the style preference above taking precedence over either.
+        vector<int> linkpath, path, bestpath;
+        CreateSlotPath(link, linkpath);
+        Cell *best = nullptr;
+        auto bestafter = false;
+        auto beststyle = false;
+        for (auto *c : *found) {
+            if (c == link) { continue; }
+            auto style = link->text.stylebits != c->text.stylebits ||
+                         link->cellcolor != c->cellcolor || link->textcolor != c->textcolor;
+            if (best != nullptr && beststyle && !style) { continue; }
+            CreateSlotPath(c, path);
+            auto after = LinkOrderBefore(linkpath, path, forward);
+            if (best == nullptr || style != beststyle ||
+                (after != bestafter ? after : LinkOrderBefore(path, bestpath, forward))) {
+                best = c;
+                bestafter = after;
+                beststyle = style;
+                std::swap(path, bestpath);
+            }
+        }
+        return best;
+    }
+
     static void CreatePath(Cell *c, vector<Selection> &path) {
         path.clear();
         while (c->parent != nullptr) {
@@ -2506,30 +2997,138 @@ struct Document {
 
     bool LastUndoSameCellAny(Cell *c) {
         return !undolist.empty() && undolist.size() != undolistsizeatfullsave &&
-               undolist.back()->cloned_from == (uintptr_t)c;
+               undolist.back()->clone && undolist.back()->cloned_from == (uintptr_t)c;
     }
 
-    bool LastUndoSameCellTextEdit(Cell *c) {
+    // textonly: the coming edit changes nothing but the text, so it may also be merged into an
+    // AddTextUndo() item that is still collecting keystrokes.
+    bool LastUndoSameCellTextEdit(Cell *c, bool textonly) {
         // hacky way to detect word boundaries to stop coalescing, but works, and
         // not a big deal if selected is not actually related to this cell
-        return !undolist.empty() && !c->grid && undolist.size() != undolistsizeatfullsave &&
-               undolist.back()->sel.EqLoc(c->parent->grid->FindCell(c)) &&
-               (!c->text.t.EndsWith(" ") || c->text.t.Len() != selected.cursor);
-    }
-
-    void AddUndo(Cell *c, bool newgeneration = true) {
+        if (undolist.empty() || undolist.size() == undolistsizeatfullsave) { return false; }
+        auto &last = *undolist.back();
+        auto coalescable = last.clone ? !c->grid
+                                      : textonly && last.textedit && last.textpos < 0 &&
+                                            last.cloned_from == (uintptr_t)c;
+        return coalescable && c->parent != nullptr &&
+               last.sel.EqLoc(c->parent->grid->FindCell(c)) &&
+               (c->text.t[c->text.t.Len() - 1] != ' ' || c->text.t.Len() != selected.cursor);
+    }
+
+    void WillModify() {
+        editcount++;
         redolist.clear();
         lastmodsinceautosave = wxGetLocalTime();
         if (!modified) {
             modified = true;
             UpdateFileName();
         }
-        if (LastUndoSameCellTextEdit(c)) { return; }
+    }
+
+    bool CoalesceTextEdit(Cell *c, bool textonly) {
+        if (!LastUndoSameCellTextEdit(c, textonly)) { return false; }
+        // Only this cell's text changes, so the edit index survives if it was current.
+        if (editindex.editcount == editcount - 1) {
+            editindex.editcount = editcount;
+            editindex.touched.push_back(c);
+        }
+        return true;
+    }
+
+    void AddUndo(Cell *c, bool newgeneration = true) {
+        WillModify();
+        // Cells left changing by earlier edits may be deleted by this one, so they go back first.
+        FlushChanges();
+        WillChange(c, true);
+        if (CoalesceTextEdit(c, false)) { return; }
         auto ui = make_unique<UndoItem>();
         ui->clone = c->Clone(nullptr);
         ui->estimated_size = c->EstimatedMemoryUse();
-        ui->sel = selected;
         ui->cloned_from = (uintptr_t)c;
+        PushUndo(c, std::move(ui), newgeneration);
+    }
+
+    static void CollectStyles(Cell *c, bool recursive, vector<CellStyle> &styles) {
+        styles.emplace_back(c);
+        if (recursive && c->grid) {
+            for (auto &child : c->grid->cells) {
+                if (child) { CollectStyles(child.get(), true, styles); }
+            }
+        }
+    }
+
+    static void SwapStyles(Cell *c, bool recursive, vector<CellStyle> &styles, size_t &i) {
+        styles[i++].Swap(c);
+        if (recursive && c->grid) {
+            for (auto &child : c->grid->cells) {
+                if (child) { SwapStyles(child.get(), true, styles, i); }
+            }
+        }
+    }
+
+    // For changes to the style, color or layout of the selected cells (and of everything below
+    // them if recursive) that do not add, remove or move any cells and leave their text alone.
+    // Only what such a change can touch is recorded, rather than a clone of the whole grid.
+    void AddStyleUndo(const Selection &s, bool recursive = false) {
+        auto *c = s.grid->cell;
+        c->ResetLayout();
+        WillModify();
+        WillChangeStyles(c, s, recursive);
+        auto ui = make_unique<UndoItem>();
+        ui->stylesel = s;
+        ui->stylesrecursive = recursive;
+        ui->colwidths = s.grid->colwidths;
+        ui->styles.emplace_back(c);
+        for (int y = s.y; y < s.y + s.ys; y++) {
+            for (int x = s.x; x < s.x + s.xs; x++) {
+                CollectStyles(s.grid->C(x, y).get(), recursive, ui->styles);
+            }
+        }
+        ui->estimated_size = sizeof(UndoItem) + ui->styles.size() * sizeof(CellStyle);
+        PushUndo(c, std::move(ui), true);
+    }
+
+    // For edits that change nothing but the text of c, such as typing or deleting characters. Only
+    // the text is kept, so typing into the header of a big subtree does not clone the subtree.
+    void AddTextUndo(Cell *c) {
+        c->ResetLayout();
+        WillModify();
+        WillChange(c, false);
+        if (CoalesceTextEdit(c, true)) { return; }
+        auto ui = make_unique<UndoItem>();
+        ui->textedit = true;
+        ui->textold = c->text.t.Get();
+        ui->textrelsize = c->text.relsize;
+        ui->textlastedit = c->text.lastedit;
+        ui->estimated_size = sizeof(UndoItem) + ui->textold.Len() * sizeof(wxChar);
+        ui->cloned_from = (uintptr_t)c;
+        PushUndo(c, std::move(ui), true);
+    }
+
+    // Trims the old text kept by AddTextUndo() down to the part that differs from the current
+    // text of the cell, once no more keystrokes can be coalesced into the item.
+    void FinishTextUndo(UndoItem &ui) {
+        if (!ui.textedit || ui.textpos >= 0) { return; }
+        auto &now = WalkPath(ui.path)->text.t;
+        auto &old = ui.textold;
+        size_t common = min(old.Len(), now.Len());
+        size_t prefix = 0;
+        while (prefix < common && old[prefix] == now[prefix]) { prefix++; }
+        size_t suffix = 0;
+        while (suffix < common - prefix &&
+               old[old.Len() - 1 - suffix] == now[now.Len() - 1 - suffix]) {
+            suffix++;
+        }
+        ui.textpos = static_cast<int>(prefix);
+        ui.textnew = now.Mid(prefix, now.Len() - prefix - suffix);
+        ui.textold = old.Mid(prefix, old.Len() - prefix - suffix);
+        ui.estimated_size =
+            sizeof(UndoItem) + (ui.textold.Len() + ui.textnew.Len()) * sizeof(wxChar);
+    }
+
+    void PushUndo(Cell *c, unique_ptr<UndoItem> ui, bool newgeneration) {
+        if (!undolist.empty()) { FinishTextUndo(*undolist.back()); }
+        ui->sel = selected;
         if (!undolist.empty()) {
             ui->generation = undolist.back()->generation + (newgeneration ? 1 : 0);
         }
@@ -2538,13 +3137,22 @@ struct Document {
         undolist.push_back(std::move(ui));
         size_t total_usage = 0;
         size_t old_list_size = undolist.size();
-        // Cull undolist. Always at least keeps last item.
+        size_t memorylimit = static_cast<size_t>(sys->undomemory) * 1024 * 1024;
+        // Move old items to disk if using more than the memory or step limit, whichever comes
+        // first. Always at least keeps last item.
         for (auto i = static_cast<int>(undolist.size()) - 1; i >= 0; i--) {
-            // Cull old items if using more than 100MB or 1000 items, whichever comes first.
-            // TODO: make configurable?
-            if (total_usage < 100 * 1024 * 1024 && undolist.size() - i < 1000) {
+            auto steps = static_cast<int>(undolist.size()) - i;
+            if (total_usage < memorylimit && steps < sys->undosteps) {
                 total_usage += undolist[i]->estimated_size;
             } else {
+                loop(j, i + 1) {
+                    // If writing fails, the rest is dropped like it was before spilling.
+                    if (!SpillUndo(*undolist[j])) {
+                        undospill.records.clear();
+                        journal.filename.Clear();
+                        break;
+                    }
+                }
                 undolist.erase(undolist.begin(), undolist.begin() + i + 1);
                 break;
             }
@@ -2553,10 +3161,448 @@ struct Document {
         undolistsizeatfullsave -= items_culled;  // Allowed to go < 0
     }
 
+    static void WriteSelection(wxDataOutputStream &dos, const Selection &s) {
+        dos.Write8(s.grid != nullptr);
+        for (auto v : {s.x, s.y, s.xs, s.ys, s.cursor, s.cursorend, s.firstdx, s.firstdy}) {
+            dos.Write32(v);
+        }
+        dos.Write8(s.textedit);
+    }
+
+    Selection ReadSelection(wxDataInputStream &dis) const {
+        Selection s;
+        // Only whether there was a grid matters: UndoEach finds the real one from selpath.
+        if (dis.Read8()) { s.grid = root->grid; }
+        for (auto *v : {&s.x, &s.y, &s.xs, &s.ys, &s.cursor, &s.cursorend, &s.firstdx,
+                        &s.firstdy}) {
+            *v = static_cast<int>(dis.Read32());
+        }
+        s.textedit = dis.Read8() != 0;
+        return s;
+    }
+
+    static void WritePath(wxDataOutputStream &dos, const vector<Selection> &path) {
+        dos.Write32(static_cast<wxUint32>(path.size()));
+        for (auto &s : path) { WriteSelection(dos, s); }
+    }
+
+    void ReadPath(wxDataInputStream &dis, vector<Selection> &path) const {
+        path.resize(dis.Read32());
+        for (auto &s : path) { s = ReadSelection(dis); }
+    }
+
+    static int SpillImageIndex(Image *image, vector<Image *> &images) {
+        if (image == nullptr) { return -1; }
+        auto it = ranges::find(images, image);
+        if (it != images.end()) { return static_cast<int>(it - images.begin()); }
+        images.push_back(image);
+        return static_cast<int>(images.size()) - 1;
+    }
+
+    long UndoDepth() const { return static_cast<long>(undospill.records.size() + undolist.size()); }
+
+    static std::tuple<uint64_t, char, double> ImageKey(const Image *image) {
+        return {image->hash, image->type, image->display_scale};
+    }
+
+    // Brings the journal up to date with the undo stack after a save. Images are written once,
+    // the first time a step refers to them, and referred to by id after that. The save marker at
+    // the end ties the journal to the exact file that was just written.
+    void SyncJournal() {
+        if (!sys->undojournal || filename.IsEmpty()) { return; }
+        auto journalname = treesheets::System::ExtName(filename, ".undo");
+        if (!undolist.empty()) { FinishTextUndo(*undolist.back()); }
+        auto &sizes = journal.stepsize;
+        auto live = std::accumulate(sizes.begin(), sizes.begin() + journal.matching, size_t(0));
+        auto popped = std::accumulate(sizes.begin() + journal.matching, sizes.end(), size_t(0));
+        if (journal.filename != journalname || !journal.file.IsOpened() ||
+            journal.dead + popped + journal.marker > live) {
+            journal.file.Close();
+            journal.filename.Clear();
+            if (!journal.file.Open(journalname, wxFile::write)) { return; }
+            char header[] = {'T', 'S', 'U', 'J', TS_VERSION};
+            journal.file.Write(header, sizeof(header));
+            journal.filename = journalname;
+            journal.depth = journal.matching = 0;
+            journal.images.clear();
+            journal.nextimage = 0;
+            journal.stepsize.clear();
+            journal.dead = journal.marker = 0;
+        }
+        wxMemoryOutputStream mos;
+        {
+            wxDataOutputStream dos(mos);
+            journal.dead += journal.marker;
+            if (journal.depth > journal.matching) {
+                dos.Write8('P');
+                dos.Write32(journal.depth - journal.matching);
+                journal.dead += popped + mos.GetLength();
+                sizes.resize(journal.matching);
+            }
+            auto spilled = static_cast<long>(undospill.records.size());
+            for (auto i = journal.matching; i < UndoDepth(); i++) {
+                auto start = mos.GetLength();
+                vector<char> data;
+                vector<Image *> images;
+                if (i < spilled) {
+                    if (!undospill.Peek(i, data)) {
+                        journal.filename.Clear();
+                        return;
+                    }
+                    images = undospill.records[i].images;
+                } else {
+                    wxMemoryOutputStream step;
+                    EncodeUndo(*undolist[i - spilled], step, images);
+                    data = StreamData(step);
+                }
+                for (auto *image : images) {
+                    auto [it, isnew] =
+                        journal.images.try_emplace(ImageKey(image), journal.nextimage);
+                    if (!isnew) { continue; }
+                    journal.nextimage++;
+                    dos.Write8('I');
+                    dos.Write32(it->second);
+                    dos.Write8(image->type);
+                    dos.WriteDouble(image->display_scale);
+                    dos.Write64(static_cast<wxUint64>(image->data.size()));
+                    mos.Write(image->data.data(), image->data.size());
+                }
+                dos.Write8('U');
+                dos.Write32(static_cast<wxUint32>(images.size()));
+                for (auto *image : images) { dos.Write32(journal.images[ImageKey(image)]); }
+                dos.Write32(static_cast<wxUint32>(data.size()));
+                mos.Write(data.data(), data.size());
+                sizes.push_back(mos.GetLength() - start);
+            }
+            auto start = mos.GetLength();
+            wxFileName fn(filename);
+            dos.Write8('S');
+            dos.Write64(static_cast<wxUint64>(fn.GetSize().GetValue()));
+            dos.Write64(static_cast<wxUint64>(fn.GetModificationTime().GetTicks()));
+            journal.marker = mos.GetLength() - start;
+        }
+        auto data = StreamData(mos);
+        if (journal.file.SeekEnd() == wxInvalidOffset ||
+            journal.file.Write(data.data(), data.size()) != data.size()) {
+            journal.file.Close();
+            journal.filename.Clear();
+            return;
+        }
+        journal.depth = journal.matching = UndoDepth();
+    }
+
+    // Reads back the undo history SyncJournal() kept for this document, if the document is
+    // still exactly the file the journal was last synced with, by this version. The steps go to
+    // the spill file, to be read when undo gets that far. Only the images those steps use are
+    // loaded, not the ones of steps that were popped since.
+    void ReplayJournal() {
+        auto journalname = treesheets::System::ExtName(filename, ".undo");
+        if (!sys->undojournal || !::wxFileExists(journalname)) { return; }
+        vector<char> buffer;
+        {
+            wxFile file(journalname);
+            if (!file.IsOpened()) { return; }
+            buffer.resize(file.Length());
+            if (file.Read(buffer.data(), buffer.size()) != static_cast<ssize_t>(buffer.size())) {
+                return;
+            }
+        }
+        if (buffer.size() < 5 || memcmp(buffer.data(), "TSUJ", 4) != 0 ||
+            buffer[4] != TS_VERSION) {
+            return;
+        }
+        struct Step {
+            vector<int> images;
+            size_t offset;
+            size_t size;
+            size_t bytes;  // of the step record and the image records before it
+        };
+        struct ImageRecord {
+            char type;
+            double scale;
+            size_t offset;
+            size_t size;
+        };
+        vector<Step> steps;
+        vector<Step> savedsteps;
+        vector<ImageRecord> imagerecords;
+        size_t savedend = 0;
+        wxFileName fn(filename);
+        auto filesize = static_cast<wxUint64>(fn.GetSize().GetValue());
+        auto filetime = static_cast<wxUint64>(fn.GetModificationTime().GetTicks());
+        wxMemoryInputStream mis(buffer.data(), buffer.size());
+        wxDataInputStream dis(mis);
+        mis.SeekI(5);
+        auto stepstart = static_cast<size_t>(mis.TellI());
+        // Whatever follows the last complete save marker is ignored, e.g. a write cut short.
+        for (auto ok = true; ok && static_cast<size_t>(mis.TellI()) < buffer.size();) {
+            auto left = [&]() { return buffer.size() - static_cast<size_t>(mis.TellI()); };
+            switch (dis.Read8()) {
+                case 'I': {
+                    auto id = static_cast<int>(dis.Read32());
+                    ImageRecord image;
+                    image.type = dis.Read8();
+                    image.scale = dis.ReadDouble();
+                    auto len = dis.Read64();
+                    if (!mis.IsOk() || len > left() || id < 0) {
+                        ok = false;
+                        break;
+                    }
+                    image.offset = static_cast<size_t>(mis.TellI());
+                    image.size = static_cast<size_t>(len);
+                    mis.SeekI(image.size, wxFromCurrent);
+                    if (id >= static_cast<int>(imagerecords.size())) {
+                        imagerecords.resize(id + 1, {0, 0, 0, 0});  // offset 0: none
+                    }
+                    imagerecords[id] = image;
+                    break;
+                }
+                case 'U': {
+                    Step step;
+                    step.images.resize(dis.Read32());
+                    for (auto &id : step.images) { id = static_cast<int>(dis.Read32()); }
+                    step.size = dis.Read32();
+                    step.offset = static_cast<size_t>(mis.TellI());
+                    if (!mis.IsOk() || step.size > left()) {
+                        ok = false;
+                        break;
+                    }
+                    mis.SeekI(step.size, wxFromCurrent);
+                    step.bytes = static_cast<size_t>(mis.TellI()) - stepstart;
+                    stepstart = static_cast<size_t>(mis.TellI());
+                    steps.push_back(std::move(step));
+                    break;
+                }
+                case 'P':
+                    steps.resize(steps.size() - min<size_t>(dis.Read32(), steps.size()));
+                    stepstart = static_cast<size_t>(mis.TellI());
+                    break;
+                case 'S': {
+                    auto size = dis.Read64();
+                    auto time = dis.Read64();
+                    if (!mis.IsOk()) {
+                        ok = false;
+                        break;
+                    }
+                    auto matches = size == filesize && time == filetime;
+                    savedend = matches ? static_cast<size_t>(mis.TellI()) : 0;
+                    savedsteps = matches ? steps : vector<Step>();
+                    stepstart = static_cast<size_t>(mis.TellI());
+                    break;
+                }
+                default: ok = false;
+            }
+        }
+        if (savedend == 0) { return; }
+        vector<Image *> images(imagerecords.size(), nullptr);
+        for (auto &step : savedsteps) {
+            for (auto id : step.images) {
+                if (id < 0 || id >= static_cast<int>(images.size()) || images[id] != nullptr) {
+                    continue;
+                }
+                auto &image = imagerecords[id];
+                if (image.offset == 0) { continue; }
+                auto *p = reinterpret_cast<const uint8_t *>(buffer.data()) + image.offset;
+                auto index = sys->AddImageToList(image.scale, vector<uint8_t>(p, p + image.size),
+                                                 image.type);
+                images[id] = sys->imagelist[index].get();
+            }
+        }
+        for (auto &step : savedsteps) {
+            vector<Image *> stepimages;
+            for (auto id : step.images) {
+                stepimages.push_back(id >= 0 && id < static_cast<int>(images.size()) ? images[id]
+                                                                                     : nullptr);
+            }
+            if (ranges::find(stepimages, nullptr) != stepimages.end() ||
+                !undospill.Write(buffer.data() + step.offset, step.size, std::move(stepimages))) {
+                undospill.records.clear();
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::resize_file(journalname.ToStdWstring(), savedend, ec);
+        if (ec || !journal.file.Open(journalname, wxFile::read_write)) {
+            undospill.records.clear();
+            return;
+        }
+        journal.filename = journalname;
+        journal.depth = journal.matching = UndoDepth();
+        loopv(i, images) if (images[i] != nullptr) { journal.images[ImageKey(images[i])] = i; }
+        journal.nextimage = static_cast<int>(imagerecords.size());
+        journal.stepsize.clear();
+        for (auto &step : savedsteps) { journal.stepsize.push_back(step.bytes); }
+        auto live = std::accumulate(journal.stepsize.begin(), journal.stepsize.end(), size_t(0));
+        journal.dead = savedend - 5 - live;
+        journal.marker = 0;
+    }
+
+    static vector<char> StreamData(const wxMemoryOutputStream &mos) {
+        vector<char> data(mos.GetLength());
+        mos.CopyTo(data.data(), data.size());
+        return data;
+    }
+
+    // Writes an undo step to the spill file. Clones use the Cell::Save() format, with image
+    // indices into a table kept in memory, so the images stay alive while the step is on disk.
+    bool SpillUndo(const UndoItem &ui) {
+        wxMemoryOutputStream mos;
+        vector<Image *> images;
+        if (!EncodeUndo(ui, mos, images)) { return false; }
+        auto data = StreamData(mos);
+        return undospill.Write(data.data(), data.size(), std::move(images));
+    }
+
+    // Compresses an undo step into mos. Image references become indices into images.
+    static bool EncodeUndo(const UndoItem &ui, wxMemoryOutputStream &mos,
+                           vector<Image *> &images) {
+        {
+            wxZlibOutputStream zos(mos, 6);
+            if (!zos.IsOk()) { return false; }
+            wxDataOutputStream dos(zos);
+            dos.Write32(ui.generation);
+            WritePath(dos, ui.path);
+            WritePath(dos, ui.selpath);
+            WriteSelection(dos, ui.sel);
+            if (ui.clone) {
+                dos.Write8('C');
+                vector<Cell *> cells;
+                ui.clone->CollectCells(cells);
+                for (auto *c : cells) {
+                    if (c->text.image != nullptr) {
+                        c->text.image->savedindex = SpillImageIndex(c->text.image, images);
+                    }
+                }
+                ui.clone->Save(dos, nullptr);
+            } else if (ui.textedit) {
+                dos.Write8('T');
+                dos.Write32(ui.textpos);
+                WriteUTF8(dos, ui.textold);
+                WriteUTF8(dos, ui.textnew);
+                dos.Write32(ui.textrelsize);
+                wxLongLong le = ui.textlastedit.GetValue();
+                dos.Write64(&le, 1);
+            } else {
+                dos.Write8('S');
+                WriteSelection(dos, ui.stylesel);
+                dos.Write8(ui.stylesrecursive);
+                dos.Write32(static_cast<wxUint32>(ui.colwidths.size()));
+                for (auto w : ui.colwidths) { dos.Write32(w); }
+                dos.Write32(static_cast<wxUint32>(ui.styles.size()));
+                for (auto &style : ui.styles) {
+                    dos.Write32(style.cellcolor);
+                    dos.Write32(style.textcolor);
+                    dos.Write32(style.celltype);
+                    dos.Write32(style.stylebits);
+                    dos.Write32(style.relsize);
+                    dos.Write32(SpillImageIndex(style.image, images));
+                    WriteUTF8(dos, style.note);
+                    wxLongLong le = style.lastedit.GetValue();
+                    dos.Write64(&le, 1);
+                    dos.Write8(style.verticaltextandgrid);
+                    dos.Write8(style.drawstyle);
+                    dos.Write32(style.bordercolor);
+                    dos.Write32(style.outerspacing);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Brings the newest spilled step back once the in-memory undo list has run out.
+    bool UnspillUndo() {
+        if (!undolist.empty() || undospill.records.empty()) { return false; }
+        vector<char> buffer;
+        vector<Image *> images;
+        if (!undospill.Read(buffer, images)) {
+            undospill.records.clear();
+            journal.filename.Clear();
+            return false;
+        }
+        wxMemoryInputStream mis(buffer.data(), buffer.size());
+        wxZlibInputStream zis(mis);
+        wxDataInputStream dis(zis);
+        auto ui = make_unique<UndoItem>();
+        ui->generation = static_cast<int>(dis.Read32());
+        ReadPath(dis, ui->path);
+        ReadPath(dis, ui->selpath);
+        ui->sel = ReadSelection(dis);
+        auto image = [&](int i) {
+            return i >= 0 && i < static_cast<int>(images.size()) ? images[i] : nullptr;
+        };
+        switch (dis.Read8()) {
+            case 'C': {
+                auto versionlastloaded = sys->versionlastloaded;
+                auto loadimageids = std::move(sys->loadimageids);
+                sys->versionlastloaded = TS_VERSION;
+                sys->loadimageids.clear();
+                for (auto *im : images) {
+                    auto it = ranges::find_if(sys->imagelist,
+                                              [im](auto &listed) { return listed.get() == im; });
+                    sys->loadimageids.push_back(static_cast<int>(it - sys->imagelist.begin()));
+                }
+                auto numcells = 0;
+                auto textbytes = 0;
+                Cell *ics = nullptr;
+                ui->clone.reset(Cell::LoadWhich(dis, nullptr, numcells, textbytes, ics));
+                sys->versionlastloaded = versionlastloaded;
+                sys->loadimageids = std::move(loadimageids);
+                if (!ui->clone) { return false; }
+                ui->estimated_size = ui->clone->EstimatedMemoryUse();
+                break;
+            }
+            case 'T': {
+                ui->textedit = true;
+                ui->textpos = static_cast<int>(dis.Read32());
+                ui->textold = ReadUTF8(dis);
+                ui->textnew = ReadUTF8(dis);
+                ui->textrelsize = static_cast<int>(dis.Read32());
+                wxLongLong le;
+                dis.Read64(&le, 1);
+                ui->textlastedit = wxDateTime(le);
+                ui->estimated_size =
+                    sizeof(UndoItem) + (ui->textold.Len() + ui->textnew.Len()) * sizeof(wxChar);
+                break;
+            }
+            case 'S': {
+                ui->stylesel = ReadSelection(dis);
+                ui->stylesrecursive = dis.Read8() != 0;
+                ui->colwidths.resize(dis.Read32());
+                for (auto &w : ui->colwidths) { w = static_cast<int>(dis.Read32()); }
+                auto n = dis.Read32();
+                ui->styles.reserve(n);
+                loop(i, static_cast<int>(n)) {
+                    auto &style = ui->styles.emplace_back();
+                    style.cellcolor = dis.Read32();
+                    style.textcolor = dis.Read32();
+                    style.celltype = static_cast<int>(dis.Read32());
+                    style.stylebits = static_cast<int>(dis.Read32());
+                    style.relsize = static_cast<int>(dis.Read32());
+                    style.image = image(static_cast<int>(dis.Read32()));
+                    style.note = ReadUTF8(dis);
+                    wxLongLong le;
+                    dis.Read64(&le, 1);
+                    style.lastedit = wxDateTime(le);
+                    style.verticaltextandgrid = dis.Read8() != 0;
+                    style.drawstyle = dis.Read8();
+                    style.bordercolor = static_cast<int>(dis.Read32());
+                    style.outerspacing = static_cast<int>(dis.Read32());
+                }
+                ui->estimated_size = sizeof(UndoItem) + n * sizeof(CellStyle);
+                break;
+            }
+            default: return false;
+        }
+        undolist.push_back(std::move(ui));
+        undolistsizeatfullsave++;
+        return true;
+    }
+
     void Undo(vector<unique_ptr<UndoItem>> &fromlist, vector<unique_ptr<UndoItem>> &tolist,
               bool redo = false) {
         for (bool next = true; next; ) {
             UndoEach(fromlist, tolist, redo);
+            if (!redo) { UnspillUndo(); }
             next = !fromlist.empty() && !tolist.empty() &&
                    fromlist.back()->generation == tolist.back()->generation;
         }
@@ -2577,12 +3623,39 @@ struct Document {
             CreatePath(beforesel.grid->cell, beforepath);
         }
 
+        editcount++;
         auto ui = std::move(fromlist.back());
         fromlist.pop_back();
+        if (!redo) { journal.matching = min(journal.matching, UndoDepth()); }
 
         Cell *c = WalkPath(ui->path);
-
-        if (c->parent != nullptr && c->parent->grid) {
+        FlushChanges();
+        if (ui->textedit) {
+            WillChange(c, false);
+        } else if (!ui->styles.empty()) {
+            WillChangeStyles(c, ui->stylesel, ui->stylesrecursive);
+        } else {
+            WillChange(c, true);
+        }
+
+        if (ui->textedit) {
+            FinishTextUndo(*ui);
+            c->text.t.Replace(ui->textpos, ui->textnew.Len(), ui->textold);
+            std::swap(ui->textold, ui->textnew);
+            std::swap(ui->textrelsize, c->text.relsize);
+            std::swap(ui->textlastedit, c->text.lastedit);
+        } else if (!ui->styles.empty()) {
+            size_t i = 0;
+            ui->styles[i++].Swap(c);
+            std::swap(ui->colwidths, c->grid->colwidths);
+            auto &s = ui->stylesel;
+            for (int y = s.y; y < s.y + s.ys; y++) {
+                for (int x = s.x; x < s.x + s.xs; x++) {
+                    SwapStyles(c->grid->C(x, y).get(), ui->stylesrecursive, ui->styles, i);
+                }
+            }
+            c->ResetChildren();
+        } else if (c->parent != nullptr && c->parent->grid) {
             Grid *g = c->parent->grid.get();
             Selection s = g->FindCell(c);
             std::swap(ui->clone, g->C(s.x, s.y));
@@ -2594,6 +3667,9 @@ struct Document {
             c->parent = nullptr;
         }
         c->ResetLayout();
+        // The subtree was swapped for the one kept in the undo item, so that is what goes back.
+        if (changing.erase(ui->clone.get()) != 0) { changing[c] = true; }
+        FlushChanges();
 
         SetSelect(ui->sel);
         if (selected.grid != nullptr) { selected.grid = WalkPath(ui->selpath)->grid; }
@@ -2604,7 +3680,8 @@ struct Document {
         tolist.push_back(std::move(ui));
 
         if (undolistsizeatfullsave > static_cast<int>(undolist.size())) {
-            undolistsizeatfullsave = -1;
+            // Far enough below zero that steps read back from disk can't bring it back.
+            undolistsizeatfullsave = std::numeric_limits<long>::min() / 2;
         }
         modified = undolistsizeatfullsave != static_cast<int>(undolist.size());
     }
@@ -2683,9 +3760,27 @@ struct Document {
         canvas->Refresh();
     }
 
+    // Changes whenever the tree or the set of tags does: both counters only ever increase.
+    long TagStamp() const { return editcount + tagsversion; }
+
+    void AddTag(const wxString &tag, uint color) {
+        tags[tag] = color;
+        tagsversion++;
+    }
+
+    void RemoveTag(const wxString &tag) {
+        if (tags.erase(tag)) { tagsversion++; }
+    }
+
+    vector<pair<wxString, uint>> SortedTags() const {
+        vector<pair<wxString, uint>> sorted(tags.begin(), tags.end());
+        std::sort(sorted.begin(), sorted.end());
+        return sorted;
+    }
+
     void RecreateTagMenu(wxMenu &menu) const {
         int i = A_TAGSET;
-        for (const auto &[tag, color] : tags) { menu.Append(i++, tag); }
+        for (const auto &[tag, color] : SortedTags()) { menu.Append(i++, tag); }
         if (!tags.empty()) { menu.AppendSeparator(); }
         menu.Append(A_TAGADD, _("&Add Cell Text as Tag"));
         menu.Append(A_TAGREMOVE, _("&Remove Cell Text from Tags"));
@@ -2694,7 +3789,7 @@ struct Document {
     wxString TagSet(int tagno) {
         if (selected.grid == nullptr) { return NoSel(); }
         int i = 0;
-        for (auto &[tag, color] : tags) {
+        for (auto &[tag, color] : SortedTags()) {
             if (i++ == tagno) {
                 selected.grid->cell->AddUndo(this);
                 loopallcellssel(c, false) {
@@ -2725,15 +3820,42 @@ struct Document {
         }
     }
 
+    static int64_t EditTime(const Cell *c) { return c->text.lastedit.GetValue().GetValue(); }
+
+    EditIndexData &EditIndex() {
+        auto &index = editindex;
+        if (index.editcount != editcount) {
+            index = EditIndexData();
+            index.editcount = editcount;
+            CollectCells(root.get());
+            vector<pair<int64_t, Cell *>> sorted;
+            sorted.reserve(itercells.size());
+            for (auto *c : itercells) {
+                sorted.emplace_back(EditTime(c), c);
+                index.lastedit[c] = EditTime(c);
+            }
+            ranges::sort(sorted);
+            index.byedit.insert(sorted.begin(), sorted.end());
+        }
+        for (auto *c : index.touched) {
+            auto &time = index.lastedit[c];
+            index.byedit.erase({time, c});
+            time = EditTime(c);
+            index.byedit.emplace(time, c);
+        }
+        index.touched.clear();
+        return index;
+    }
+
     void ApplyEditFilter() {
         searchfilter = false;
         editfilter = std::clamp(editfilter, 1, 99);
-        CollectCells(root.get());
-        ranges::sort(itercells, [](auto a, auto b) {
-            // sort in descending order
-            return a->text.lastedit > b->text.lastedit;
-        });
-        loopv(i, itercells) itercells[i]->text.filtered = i > itercells.size() * editfilter / 100;
+        auto &byedit = EditIndex().byedit;
+        size_t shown = byedit.size() * editfilter / 100;
+        size_t i = 0;
+        for (auto it = byedit.rbegin(); it != byedit.rend(); ++it) {
+            it->second->text.filtered = i++ > shown;
+        }
         root->ResetChildren();
         UpdateLayout();
         ScrollIfSelectionOutOfView();
@@ -2742,10 +3864,11 @@ struct Document {
 
     void ApplyEditRangeFilter(wxDateTime &rangebegin, wxDateTime &rangeend) {
         searchfilter = false;
-        CollectCells(root.get());
-        for (auto *c : itercells) {
-            c->text.filtered = !c->text.lastedit.IsBetween(rangebegin, rangeend);
-        }
+        auto &byedit = EditIndex().byedit;
+        for (auto &[time, c] : byedit) { c->text.filtered = true; }
+        auto first = byedit.lower_bound({rangebegin.GetValue().GetValue(), nullptr});
+        auto last = byedit.lower_bound({rangeend.GetValue().GetValue() + 1, nullptr});
+        for (auto it = first; it != last; ++it) { it->second->text.filtered = false; }
         root->ResetChildren();
         UpdateLayout();
         ScrollIfSelectionOutOfView();
@@ -2761,23 +3884,30 @@ struct Document {
 
     void SetSearchFilter(bool on) {
         searchfilter = on;
-        loopallcells(c) c->text.filtered = on && !c->text.IsInSearch();
+        CollectCells(root.get());
+        ParallelFor(itercells.size(), 4096, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; i++) {
+                itercells[i]->text.filtered = on && !itercells[i]->text.IsInSearch();
+            }
+        });
         root->ResetChildren();
         UpdateLayout();
         ScrollIfSelectionOutOfView();
         canvas->Refresh();
     }
 
-    void ExportAllImages(const wxString &filename, Cell *exportroot) {
+    static bool ExportAllImages(const wxString &filename, Cell *exportroot) {
         std::set<Image *> exportimages;
-        CollectCells(exportroot);
-        for (auto *c : itercells) {
+        vector<Cell *> cells;
+        exportroot->CollectCells(cells);
+        for (auto *c : cells) {
             if (c->text.image != nullptr) { exportimages.insert(c->text.image); }
         }
         wxFileName fn(filename);
         auto directory = fn.GetPathWithSep();
         for (auto *image : exportimages) {
-            if (!image->ExportToDirectory(directory)) { break; }
+            if (!image->ExportToDirectory(directory)) { return false; }
         }
+        return true;
     }
 };
@@ -71,7 +71,7 @@ struct Evaluator {
         ops[L"if"] = make_unique<_if>();
     }
 
-    int InferCellType(Text &t) { return ops.contains(t.t) ? CT_CODE : CT_DATA; }
+    int InferCellType(Text &t) { return ops.contains(t.t.Get()) ? CT_CODE : CT_DATA; }
 
     unique_ptr<Cell> Lookup(const wxString &name) {
         auto it = vars.find(name);
@@ -85,7 +85,7 @@ struct Evaluator {
     }
 
     void Assign(const Cell *sym, const Cell *val) {
-        this->SetSymbol(sym->text.t, val->Clone(nullptr));
+        this->SetSymbol(sym->text.t.Get(), val->Clone(nullptr));
         if (sym->grid && val->grid) { this->DestructuringAssign(sym->grid, val->Clone(nullptr)); }
     }
 
@@ -94,7 +94,7 @@ struct Evaluator {
         Grid const *vg = val->grid.get();
         if (ng->xs == vg->xs && ng->ys == vg->ys) {
             loop(x, ng->xs) loop(y, ng->ys) {
-                this->SetSymbol(ng->C(x, y)->text.t, vg->C(x, y)->Clone(nullptr));
+                this->SetSymbol(ng->C(x, y)->text.t.Get(), vg->C(x, y)->Clone(nullptr));
             }
         }
     }
@@ -140,7 +140,7 @@ struct Evaluator {
                     } else {
                         vector<shared_ptr<Grid>> gs;
                         g->Split(gs, vert);
-                        g = make_shared<Grid>(vert ? gs.size() : 1, vert ? 1 : gs.size());
+                        g = make_pooled<Grid>(vert ? gs.size() : 1, vert ? 1 : gs.size());
                         auto c = make_unique<Cell>(nullptr, left.get(), CT_DATA, g);
                         loopv(i, gs) {
                             auto res = op->runl(gs[i]);
@@ -171,7 +171,7 @@ struct Evaluator {
                 if (!t1.t.IsEmpty() && !t2.t.IsEmpty()) {
                     t1.SetNum(op->runnn(t1.GetNum(), t2.GetNum()));
                 } else if (g1 && g2 && g1->xs == g2->xs && g1->ys == g2->ys) {
-                    auto g = make_shared<Grid>(g1->xs, g1->ys);
+                    auto g = make_pooled<Grid>(g1->xs, g1->ys);
                     auto c = make_unique<Cell>(nullptr, left.get(), CT_DATA, g);
                     loop(x, g->xs) loop(y, g->ys) {
                         unique_ptr<Cell> c1 = std::move(g1->C(x, y));
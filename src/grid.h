@@ -13,18 +13,24 @@ struct Grid {
     int user_grid_outer_spacing {g_usergridouterspacing_default};
     int cell_margin {0};
     int bordercolor {g_bordercolor_default};
+    // cells holds gaprows empty rows before row gapy. Row insertions and deletions move the gap
+    // to where they happen, so only the rows in between shift, not everything after them.
+    int gapy {0};
+    int gaprows {0};
     bool horiz {false};
     bool tinyborder {false};
     bool folded {false};
 
+    int Index(int x, int y) const { return x + (y < gapy ? y : y + gaprows) * xs; }
+
     unique_ptr<Cell> &C(int x, int y) {
         ASSERT(x >= 0 && y >= 0 && x < xs && y < ys);
-        return cells[x + y * xs];
+        return cells[Index(x, y)];
     }
 
     Cell *C(int x, int y) const {
         ASSERT(x >= 0 && y >= 0 && x < xs && y < ys);
-        return cells[x + y * xs].get();
+        return cells[Index(x, y)].get();
     }
 
     #define foreachcell(c)                \
@@ -77,6 +83,7 @@ struct Grid {
 
     void InitCells(Cell *clonestylefrom = nullptr) {
         foreachcell(c) c = make_unique<Cell>(cell, clonestylefrom);
+        ReindexCells();
     }
     void CloneStyleFrom(Grid *o) {
         bordercolor = o->bordercolor;
@@ -94,20 +101,20 @@ struct Grid {
         g->user_grid_outer_spacing = user_grid_outer_spacing;
         g->folded = folded;
         foreachcell(c) g->C(x, y) = c->Clone(g->cell);
+        g->ReindexCells();
         loop(x, xs) g->colwidths[x] = colwidths[x];
     }
 
     unique_ptr<Cell> CloneSel(const Selection &sel) {
-        auto cl = make_unique<Cell>(nullptr, sel.grid->cell, CT_DATA, make_shared<Grid>(sel.xs, sel.ys));
+        auto cl = make_unique<Cell>(nullptr, sel.grid->cell, CT_DATA, make_pooled<Grid>(sel.xs, sel.ys));
         foreachcellinsel(c, sel) cl->grid->C(x - sel.x, y - sel.y) = c->Clone(cl.get());
         loop(i, sel.xs) cl->grid->colwidths[i] = sel.grid->colwidths[sel.x + i];
         return cl;
     }
 
-    size_t EstimatedMemoryUse() {
-        size_t sum = 0;
-        foreachcell(c) sum += c->EstimatedMemoryUse();
-        return sizeof(Grid) + xs * ys * sizeof(Cell *) + sum;
+    void Count(size_t &bytes, int &cells) {
+        bytes += sizeof(Grid) + this->cells.size() * sizeof(Cell *);
+        foreachcell(c) c->Count(bytes, cells);
     }
 
     void SetOrient() {
@@ -123,9 +130,10 @@ struct Grid {
         tinyborder = true;
         foreachcell(c) {
             c->LazyLayout(doc, dc, depth + 1, colwidths[x], forcetiny);
-            tinyborder = c->tiny && tinyborder;
-            xa[x] = max(xa[x], c->sx);
-            ya[y] = max(ya[y], c->sy);
+            auto &l = c->L();
+            tinyborder = l.tiny && tinyborder;
+            xa[x] = max(xa[x], l.sx);
+            ya[y] = max(ya[y], l.sy);
         }
         view_grid_outer_spacing =
             tinyborder || cell->drawstyle != DS_GRID ? 0 : user_grid_outer_spacing;
@@ -139,24 +147,25 @@ struct Grid {
         loop(i, ys) sy += ya[i];
         int cx = view_grid_outer_spacing + view_margin + g_line_width + cell_margin + startx;
         int cy = view_grid_outer_spacing + view_margin + g_line_width + cell_margin + starty;
-        if (!cell->tiny) {
+        if (!cell->L().tiny) {
             cx += g_margin_extra;
             cy += g_margin_extra;
         }
         foreachcell(c) {
-            c->ox = cx;
-            c->oy = cy;
+            auto &l = c->L();
+            l.ox = cx;
+            l.oy = cy;
             if (c->drawstyle == DS_BLOBLINE && !c->grid) {
-                assert(c->sy <= ya[y]);
-                c->ycenteroff = (ya[y] - c->sy) / 2;
+                assert(l.sy <= ya[y]);
+                l.ycenteroff = (ya[y] - l.sy) / 2;
             }
-            c->sx = xa[x];
-            c->sy = ya[y];
+            l.sx = xa[x];
+            l.sy = ya[y];
             cx += xa[x] + g_line_width + cell_margin * 2;
             if (x == xs - 1) {
                 cy += ya[y] + g_line_width + cell_margin * 2;
                 cx = view_grid_outer_spacing + view_margin + g_line_width + cell_margin + startx;
-                if (!cell->tiny) { cx += g_margin_extra; }
+                if (!cell->L().tiny) { cx += g_margin_extra; }
             }
         }
         return tinyborder;
@@ -166,25 +175,26 @@ struct Grid {
     void Render(Document *doc, int bx, int by, DC &dc, int depth, int sx, int sy, int xoff,
                 int yoff) {
         foreachcell(c) {
-            int cx = bx + c->ox;
-            int cy = by + c->oy;
-            if (cx < doc->maxx && cx + c->sx > doc->scrollx && cy < doc->maxy &&
-                cy + c->sy > doc->scrolly) {
+            auto &l = c->L();
+            int cx = bx + l.ox;
+            int cy = by + l.oy;
+            if (cx < doc->maxx && cx + l.sx > doc->scrollx && cy < doc->maxy &&
+                cy + l.sy > doc->scrolly) {
                 c->Render(doc, cx, cy, dc, depth + 1, x == 0 ? view_margin : g_line_width,
                           x == xs - 1 ? view_margin : 0, y == 0 ? view_margin : g_line_width,
                           y == ys - 1 ? view_margin : 0, colwidths[x], cell_margin);
             }
         }
 
-        xoff = C(0, 0)->ox - view_margin - view_grid_outer_spacing - 1;
-        yoff = C(0, 0)->oy - view_margin - view_grid_outer_spacing - 1;
-        int maxx = C(xs - 1, 0)->ox + C(xs - 1, 0)->sx;
-        int maxy = C(0, ys - 1)->oy + C(0, ys - 1)->sy;
+        xoff = C(0, 0)->L().ox - view_margin - view_grid_outer_spacing - 1;
+        yoff = C(0, 0)->L().oy - view_margin - view_grid_outer_spacing - 1;
+        int maxx = C(xs - 1, 0)->L().ox + C(xs - 1, 0)->L().sx;
+        int maxy = C(0, ys - 1)->L().oy + C(0, ys - 1)->L().sy;
         if (tinyborder || cell->drawstyle == DS_GRID) {
             int ldelta = static_cast<int>(view_grid_outer_spacing != 0);
             auto drawlines = [&]() {
                 for (int x = ldelta; x <= xs - ldelta; x++) {
-                    int xl = (x == xs ? maxx : C(x, 0)->ox - g_line_width) + bx;
+                    int xl = (x == xs ? maxx : C(x, 0)->L().ox - g_line_width) + bx;
                     if (xl >= doc->scrollx && xl <= doc->maxx) {
                         loop(line, g_line_width) {
                             dc.DrawLine(
@@ -194,7 +204,7 @@ struct Grid {
                     }
                 }
                 for (int y = ldelta; y <= ys - ldelta; y++) {
-                    int yl = (y == ys ? maxy : C(0, y)->oy - g_line_width) + by;
+                    int yl = (y == ys ? maxy : C(0, y)->L().oy - g_line_width) + by;
                     if (yl >= doc->scrolly && yl <= doc->maxy) {
                         loop(line, g_line_width) {
                             dc.DrawLine(max(doc->scrollx,
@@ -225,18 +235,20 @@ struct Grid {
             drawlines();
         }
 
-        if (cell->drawstyle == DS_BLOBLINE && !tinyborder && cell->HasHeader() && !cell->tiny) {
+        auto &cl = cell->L();
+        if (cell->drawstyle == DS_BLOBLINE && !tinyborder && cell->HasHeader() && !cl.tiny) {
             const int arcsize = 8;
-            int srcy = by + cell->ycenteroff +
-                       (cell->verticaltextandgrid ? cell->tys + 2 : cell->tys / 2) + g_margin_extra;
+            int srcy = by + cl.ycenteroff +
+                       (cell->verticaltextandgrid ? cl.tys + 2 : cl.tys / 2) + g_margin_extra;
             // fixme: the 8 is chosen to fit the smallest text size, not very portable
-            int srcx = bx + (cell->verticaltextandgrid ? 8 : cell->txs + 4) + g_margin_extra;
+            int srcx = bx + (cell->verticaltextandgrid ? 8 : cl.txs + 4) + g_margin_extra;
             int destyfirst = -1;
             int destylast = -1;
             dc.SetPen(*wxGREY_PEN);
-            foreachcelly(c) if (c->HasContent() && !c->tiny) {
-                int desty = c->ycenteroff + by + c->oy + c->tys / 2 + g_margin_extra;
-                int destx = bx + c->ox - 2 + g_margin_extra;
+            foreachcelly(c) if (c->HasContent() && !c->L().tiny) {
+                auto &l = c->L();
+                int desty = l.ycenteroff + by + l.oy + l.tys / 2 + g_margin_extra;
+                int destx = bx + l.ox - 2 + g_margin_extra;
                 bool visible = srcx < doc->maxx && destx > doc->scrollx &&
                                desty - arcsize < doc->maxy && desty + arcsize > doc->scrolly;
                 if (abs(srcy - desty) < arcsize && !cell->verticaltextandgrid) {
@@ -284,23 +296,24 @@ struct Grid {
 
     template<typename DC> void FindXY(Document *doc, int px, int py, DC &dc) {
         foreachcell(c) {
-            int bx = px - c->ox;
-            int by = py - c->oy;
-            if (bx >= 0 && by >= -g_line_width - g_selmargin && bx < c->sx && by < g_selmargin) {
+            auto &l = c->L();
+            int bx = px - l.ox;
+            int by = py - l.oy;
+            if (bx >= 0 && by >= -g_line_width - g_selmargin && bx < l.sx && by < g_selmargin) {
                 doc->hover = Selection(cell->grid, x, y, 1, 0);
                 return;
             }
-            if (bx >= 0 && by >= c->sy - g_selmargin && bx < c->sx &&
-                by < c->sy + g_line_width + g_selmargin) {
+            if (bx >= 0 && by >= l.sy - g_selmargin && bx < l.sx &&
+                by < l.sy + g_line_width + g_selmargin) {
                 doc->hover = Selection(cell->grid, x, y + 1, 1, 0);
                 return;
             }
-            if (bx >= -g_line_width - g_selmargin && by >= 0 && bx < g_selmargin && by < c->sy) {
+            if (bx >= -g_line_width - g_selmargin && by >= 0 && bx < g_selmargin && by < l.sy) {
                 doc->hover = Selection(cell->grid, x, y, 0, 1);
                 return;
             }
-            if (bx >= c->sx - g_selmargin && by >= 0 && bx < c->sx + g_line_width + g_selmargin &&
-                by < c->sy) {
+            if (bx >= l.sx - g_selmargin && by >= 0 && bx < l.sx + g_line_width + g_selmargin &&
+                by < l.sy) {
                 doc->hover = Selection(cell->grid, x + 1, y, 0, 1);
                 return;
             }
@@ -309,26 +322,14 @@ struct Grid {
                 if (doc->hover.grid) { return; }
                 doc->hover = Selection(cell->grid, x, y, 1, 1);
                 if (c->HasText()) {
-                    c->text.FindCursor(doc, bx, by - c->ycenteroff, dc, doc->hover, colwidths[x]);
+                    c->text.FindCursor(doc, bx, by - l.ycenteroff, dc, doc->hover, colwidths[x]);
                 }
                 return;
             }
         }
     }
 
-    Cell *FindLink(const Selection &sel, Cell *link, Cell *best, bool &lastthis, bool &stylematch,
-                   bool forward, bool image) {
-        if (forward) {
-            foreachcell(c) best =
-                c->FindLink(sel, link, best, lastthis, stylematch, forward, image);
-        } else {
-            foreachcellrev(c) best =
-                c->FindLink(sel, link, best, lastthis, stylematch, forward, image);
-        }
-        return best;
-    }
-
-    Cell *FindNextSearchMatch(const wxString &search, Cell *best, Cell *selected,
+    Cell *FindNextSearchMatch(const SearchMatcher &search, Cell *best, Cell *selected,
                               bool &lastwasselected, bool reverse) {
         if (folded && !sys->searchfolded) return best;
         if (reverse) {
@@ -346,15 +347,32 @@ struct Grid {
         return best;
     }
 
-    void FindReplaceAll(const wxString &s, const wxString &ls) {
-        foreachcell(c) c->FindReplaceAll(s, ls);
+    void FindReplaceAll(const wxString &s) {
+        foreachcell(c) c->FindReplaceAll(s);
     }
 
     void ReplaceCell(Cell *o, Cell *n) {
-        foreachcell(c) if (c.get() == o) { c.reset(n); }
+        foreachcell(c) if (c.get() == o) {
+            c.reset(n);
+            n->slot = Index(x, y);
+        }
+    }
+    // Sets the slot of every cell to its current position, after cells were moved around.
+    void ReindexCells() {
+        loopv(i, cells) if (cells[i]) { cells[i]->slot = i; }
     }
+
     Selection FindCell(Cell *o) {
-        foreachcell(c) if (c.get() == o) { return {cell->grid, x, y, 1, 1}; }
+        // The slot is only trusted if it still points back at the cell, anything that moved
+        // without a ReindexCells() is searched for and gets its slot fixed up.
+        if (o->slot >= 0 && o->slot < cells.size() && cells[o->slot].get() == o) {
+            int row = o->slot / xs;
+            return {cell->grid, o->slot % xs, row < gapy ? row : row - gaprows, 1, 1};
+        }
+        foreachcell(c) if (c.get() == o) {
+            o->slot = Index(x, y);
+            return {cell->grid, x, y, 1, 1};
+        }
         return {};
     }
 
@@ -365,7 +383,7 @@ struct Grid {
 
     template<typename DC>
     void DrawCursor(Document *doc, DC &dc, Selection &sel, bool full, uint color) {
-        if (auto *c = sel.GetCell(); c != nullptr && !c->tiny && (c->HasText() || !c->grid)) {
+        if (auto *c = sel.GetCell(); c != nullptr && !c->L().tiny && (c->HasText() || !c->grid)) {
             c->text.DrawCursor(doc, dc, sel, full, color, colwidths[sel.x]);
         }
     }
@@ -375,21 +393,21 @@ struct Grid {
         if (sel.xs == 0) {
             auto *c = C(sel.x - static_cast<int>(sel.x == xs), sel.y).get();
             int x = c->GetX(doc) +
-                    (c->sx + g_line_width + cell_margin) * static_cast<int>(sel.x == xs) -
+                    (c->L().sx + g_line_width + cell_margin) * static_cast<int>(sel.x == xs) -
                     g_line_width - cell_margin;
             loop(line, g_line_width)
                 dc.DrawLine(x + line, max(cell->GetY(doc), doc->scrolly), x + line,
-                            min(cell->GetY(doc) + cell->sy, doc->maxy));
-            DrawRectangle(dc, colour, x - 1, c->GetY(doc), g_line_width + 2, c->sy);
+                            min(cell->GetY(doc) + cell->L().sy, doc->maxy));
+            DrawRectangle(dc, colour, x - 1, c->GetY(doc), g_line_width + 2, c->L().sy);
         } else {
             auto *c = C(sel.x, sel.y - static_cast<int>(sel.y == ys)).get();
             int y = c->GetY(doc) +
-                    (c->sy + g_line_width + cell_margin) * static_cast<int>(sel.y == ys) -
+                    (c->L().sy + g_line_width + cell_margin) * static_cast<int>(sel.y == ys) -
                     g_line_width - cell_margin;
             loop(line, g_line_width)
                 dc.DrawLine(max(cell->GetX(doc), doc->scrollx), y + line,
-                            min(cell->GetX(doc) + cell->sx, doc->maxx), y + line);
-            DrawRectangle(dc, colour, c->GetX(doc), y - 1, c->sx, g_line_width + 2);
+                            min(cell->GetX(doc) + cell->L().sx, doc->maxx), y + line);
+            DrawRectangle(dc, colour, c->GetX(doc), y - 1, c->L().sx, g_line_width + 2);
         }
     }
 
@@ -398,27 +416,27 @@ struct Grid {
             if (sel.xs != 0) {
                 if (sel.y < ys) {
                     auto *tl = C(sel.x, sel.y).get();
-                    return {tl->GetX(doc), tl->GetY(doc), tl->sx, 0};
+                    return {tl->GetX(doc), tl->GetY(doc), tl->L().sx, 0};
                 } else {
                     auto *br = C(sel.x, ys - 1).get();
-                    return {br->GetX(doc), br->GetY(doc) + br->sy, br->sx, 0};
+                    return {br->GetX(doc), br->GetY(doc) + br->L().sy, br->L().sx, 0};
                 }
             } else {
                 if (sel.x < xs) {
                     auto *tl = C(sel.x, sel.y).get();
-                    return {tl->GetX(doc), tl->GetY(doc), 0, tl->sy};
+                    return {tl->GetX(doc), tl->GetY(doc), 0, tl->L().sy};
                 } else {
                     auto *br = C(xs - 1, sel.y).get();
-                    return {br->GetX(doc) + br->sx, br->GetY(doc), 0, br->sy};
+                    return {br->GetX(doc) + br->L().sx, br->GetY(doc), 0, br->L().sy};
                 }
             }
         } else {
             auto *tl = C(sel.x, sel.y).get();
             auto *br = C(sel.x + sel.xs - 1, sel.y + sel.ys - 1).get();
             wxRect r(tl->GetX(doc) - cell_margin, tl->GetY(doc) - cell_margin,
-                     br->GetX(doc) + br->sx - tl->GetX(doc) + cell_margin * 2,
-                     br->GetY(doc) + br->sy - tl->GetY(doc) + cell_margin * 2);
-            if (minimal && tl == br) { r.width -= tl->sx - tl->minx; }
+                     br->GetX(doc) + br->L().sx - tl->GetX(doc) + cell_margin * 2,
+                     br->GetY(doc) + br->L().sy - tl->GetY(doc) + cell_margin * 2);
+            if (minimal && tl == br) { r.width -= tl->L().sx - tl->L().minx; }
             return r;
         }
     }
@@ -451,15 +469,63 @@ struct Grid {
         }
     }
 
+    // Moves the gap to row y, shifting the rows in between across it.
+    void MoveGap(int y) {
+        if (gaprows > 0) {
+            for (int row = gapy - 1; row >= y; row--) { MoveRow(row, row + gaprows); }
+            for (int row = gapy; row < y; row++) { MoveRow(row + gaprows, row); }
+        }
+        gapy = y;
+    }
+
+    void MoveRow(int from, int to) {
+        loop(x, xs) {
+            auto &c = cells[x + to * xs];
+            c = std::move(cells[x + from * xs]);
+            if (c) { c->slot = x + to * xs; }
+        }
+    }
+
+    // Leaves cells without a gap, for code that rebuilds it as a whole.
+    void CloseGap() {
+        MoveGap(ys);
+        cells.resize(xs * ys);
+        gaprows = 0;
+    }
+
+    void InsertRows(int dy, int nys) {
+        if (gaprows < nys) {
+            // Grow the gap along with the grid, so a run of insertions rarely has to do this.
+            CloseGap();
+            gaprows = nys + max(ys / 4, 4);
+            cells.resize(xs * (ys + gaprows));
+        }
+        MoveGap(dy);
+        gapy += nys;
+        gaprows -= nys;
+        ys += nys;
+    }
+
     void DeleteCells(int dx, int dy, int nxs, int nys) {
+        if (nxs == 0 && nys == -1) {
+            MoveGap(dy);
+            loop(x, xs) cells[x + (dy + gaprows) * xs].reset();
+            gaprows++;
+            ys--;
+            if (gaprows > max(ys, 64)) { CloseGap(); }
+            SetOrient();
+            return;
+        }
         vector<unique_ptr<Cell>> ncells;
         ncells.reserve((xs + nxs) * (ys + nys));
         foreachcell(c) if (x != dx && y != dy) { ncells.push_back(std::move(c)); }
         cells = std::move(ncells);
+        gapy = gaprows = 0;
         xs += nxs;
         ys += nys;
         if (dx >= 0) { colwidths.erase(colwidths.begin() + dx); }
         SetOrient();
+        ReindexCells();
     }
 
     void MultiCellDelete(Document *doc, Selection &sel) {
@@ -526,32 +592,41 @@ struct Grid {
     }
 
     void InsertCells(int dx, int dy, int nxs, int nys, unique_ptr<Cell> nc = nullptr) {
-        vector<unique_ptr<Cell>> ocells = std::move(cells);
-        int oxs = xs;
-        int oys = ys;
-        xs += nxs;
-        ys += nys;
-        cells.resize(xs * ys);
-        SetOrient();
-        int opos = 0;
-        foreachcell(c) {
-            if (!(nxs > 0 && x >= dx && x < dx + nxs) && !(nys > 0 && y >= dy && y < dy + nys)) {
-                c = std::move(ocells[opos++]);
-            }
-        }
-        foreachcell(c) {
-            if ((nxs > 0 && x >= dx && x < dx + nxs) || (nys > 0 && y >= dy && y < dy + nys)) {
-                if (nc) {
-                    c = std::move(nc);
-                } else {
-                    int sx = nxs != 0 ? dx == 0 ? nxs : max(0, min(dx - 1, xs - 1)) : x;
-                    int sy = nys != 0 ? dy == 0 ? nys : max(0, min(dy - 1, ys - 1)) : y;
-                    Cell *colcell = C(sx, sy).get();
-                    c = make_unique<Cell>(cell, colcell);
-                    if (colcell != nullptr) { c->text.relsize = colcell->text.relsize; }
+        if (nxs == 0 && nys > 0) {
+            InsertRows(dy, nys);
+        } else {
+            CloseGap();
+            vector<unique_ptr<Cell>> ocells = std::move(cells);
+            xs += nxs;
+            ys += nys;
+            cells.resize(xs * ys);
+            int opos = 0;
+            foreachcell(c) {
+                if (!(nxs > 0 && x >= dx && x < dx + nxs) &&
+                    !(nys > 0 && y >= dy && y < dy + nys)) {
+                    c = std::move(ocells[opos++]);
                 }
             }
+            ReindexCells();
         }
+        SetOrient();
+        // Only the new cells are visited, in the same order as a foreachcell would.
+        auto fill = [&](int x, int y) {
+            auto &c = C(x, y);
+            if (c) { return; }
+            if (nc) {
+                c = std::move(nc);
+            } else {
+                int sx = nxs != 0 ? dx == 0 ? nxs : max(0, min(dx - 1, xs - 1)) : x;
+                int sy = nys != 0 ? dy == 0 ? nys : max(0, min(dy - 1, ys - 1)) : y;
+                Cell *colcell = C(sx, sy).get();
+                c = make_unique<Cell>(cell, colcell);
+                if (colcell != nullptr) { c->text.relsize = colcell->text.relsize; }
+            }
+            c->slot = Index(x, y);
+        };
+        if (nys > 0) { loop(y, nys) loop(x, xs) fill(x, dy + y); }
+        if (nxs > 0) { loop(y, ys) loop(x, nxs) fill(dx + x, y); }
         if (dx >= 0 && nxs > 0) { colwidths.insert(colwidths.begin() + dx, nxs, cell->ColWidth()); }
     }
 
@@ -563,36 +638,37 @@ struct Grid {
         dos.Write8(static_cast<wxUint8>(cell->verticaltextandgrid));
         dos.Write8(static_cast<wxUint8>(folded));
         loop(x, xs) dos.Write32(colwidths[x]);
-        foreachcellconst(c) c->Save(dos, ocs);
-    }
-
-    bool LoadContents(wxDataInputStream &dis, int &numcells, int &textbytes, Cell *&ics) {
-        if (sys->versionlastloaded >= 10) {
-            bordercolor = dis.Read32() & 0xFFFFFF;
-            user_grid_outer_spacing =
-                std::clamp(static_cast<int>(dis.Read32()), 0, g_max_grid_outer_spacing);
-            if (sys->versionlastloaded >= 11) {
-                cell->verticaltextandgrid = dis.Read8() != 0;
-                if (sys->versionlastloaded >= 13) {
-                    if (sys->versionlastloaded >= 16) {
-                        folded = dis.Read8() != 0;
-                        if (folded && sys->versionlastloaded <= 17) {
-                            // Before v18, folding would use the image slot. So if this cell
-                            // contains an image, clear it.
-                            cell->text.image = nullptr;
-                        }
-                    }
-                    loop(x, xs) colwidths[x] =
-                        std::max(static_cast<int>(dis.Read32()), g_min_colwidth);
-                }
+        // Long runs of identical blank cells, common in big sparse tables, are written only once.
+        for (int i = 0; i < xs * ys;) {
+            int run = BlankRun(i, ocs);
+            if (run >= g_min_blank_run) {
+                C(i % xs, i / xs)->Save(dos, ocs, run);
+                i += run;
+            } else {
+                for (int end = i + run; i < end; i++) { C(i % xs, i / xs)->Save(dos, ocs); }
             }
         }
-        foreachcell(c) {
-            Cell *rc = Cell::LoadWhich(dis, cell, numcells, textbytes, ics);
-            if (rc == nullptr) { return false; }
-            c.reset(rc);
+    }
+
+    // The number of cells from cell i on, in row order, that are the same blank as cell i.
+    int BlankRun(int i, Cell *ocs) const {
+        auto *c = C(i % xs, i / xs);
+        int run = 1;
+        while (i + run < xs * ys && c->SameBlank(C((i + run) % xs, (i + run) / xs), ocs)) {
+            run++;
         }
-        return true;
+        return run;
+    }
+
+    // Whether Save() writes a TS_BLANKS run for this grid or any grid below it.
+    bool HasBlankRuns(Cell *ocs) const {
+        for (int i = 0; i < xs * ys;) {
+            int run = BlankRun(i, ocs);
+            if (run >= g_min_blank_run) { return true; }
+            i += run;
+        }
+        foreachcellconst(c) if (c->grid && c->grid->HasBlankRuns(ocs)) { return true; }
+        return false;
     }
 
     static void Formatter(wxString &r, int format, int indent, const wxString &xml,
@@ -609,18 +685,26 @@ struct Grid {
         }
     }
 
-    wxString ToText(int indent, const Selection &sel, int format, Document *doc, bool inheritstyle,
-                    Cell *root) {
-        return ConvertToText(SelectAll(), indent + 2, format, doc, inheritstyle, root);
+    void ToText(TextWriter &w, int indent, const Selection &sel, int format, Document *doc,
+                bool inheritstyle, Cell *root) {
+        ConvertToText(w, SelectAll(), indent + 2, format, doc, inheritstyle, root);
     };
 
     wxString ConvertToText(const Selection &sel, int indent, int format, Document *doc,
                            bool inheritstyle, Cell *root) {
-        wxString r;
+        TextWriter w(nullptr, Document::CurrentExportSettings());
+        ConvertToText(w, sel, indent, format, doc, inheritstyle, root);
+        return w.text;
+    }
+
+    void ConvertToText(TextWriter &w, const Selection &sel, int indent, int format, Document *doc,
+                       bool inheritstyle, Cell *root) {
+        auto &r = w.text;
         const int root_grid_spacing = 2;  // Can't be adjusted in editor, so use a default.
         const int font_size = 14 - indent / 2;
         const int grid_border_width =
-            cell == doc->root.get() ? root_grid_spacing : user_grid_outer_spacing - 1;
+            doc != nullptr && cell == doc->root.get() ? root_grid_spacing
+                                                      : user_grid_outer_spacing - 1;
 
         wxString xmlstr("<grid");
         if (folded) { xmlstr.Append(wxString::Format(" folded=\"%d\"", folded)); }
@@ -638,14 +722,14 @@ struct Grid {
                   wxString::Format("<ul style=\"font-size: %dpt;\">\n", font_size));
         foreachcellinsel(c, sel) {
             if (x == sel.x) { Formatter(r, format, indent, "<row>\n", "<tr>\n", ""); }
-            r.Append(c->ToText(indent, sel, format, doc, inheritstyle, root));
+            c->ToText(w, indent, sel, format, doc, inheritstyle, root);
             if (format == A_EXPCSV) { r.Append(x == sel.x + sel.xs - 1 ? '\n' : ','); }
             if (x == sel.x + sel.xs - 1) {
                 Formatter(r, format, indent, "</row>\n", "</tr>\n", "");
             }
+            w.Spill();
         }
         Formatter(r, format, indent, "</grid>\n", "</table>\n", "</ul>\n");
-        return r;
     }
 
     void RelSize(int dir, int zoomdepth) { foreachcell(c) c->RelSize(dir, zoomdepth); }
@@ -675,6 +759,7 @@ struct Grid {
         } else {
             foreachcellinselrev(c, sel) std::swap(c, C((x + dx + xs) % xs, (y + dy + ys) % ys));
         }
+        ReindexCells();
     }
 
     void Add(unique_ptr<Cell> c) {
@@ -714,7 +799,7 @@ struct Grid {
     }
 
     void SetStyle(Document *doc, const Selection &sel, int sb) {
-        cell->AddUndo(doc);
+        doc->AddStyleUndo(sel);
         cell->ResetChildren();
         foreachcellinsel(c, sel) {
             c->text.stylebits ^= sb;
@@ -725,71 +810,36 @@ struct Grid {
     }
 
     void ColorChange(Document *doc, int which, uint color, const Selection &sel) {
-        cell->AddUndo(doc);
+        doc->AddStyleUndo(sel);
         cell->ResetChildren();
         foreachcellinsel(c, sel) c->ColorChange(doc, which, color);
         doc->UpdateLayout();
         doc->canvas->Refresh();
     }
 
-    void ReplaceStr(Document *doc, const wxString &s, const wxString &ls, const Selection &sel) {
+    void ReplaceStr(Document *doc, const wxString &s, const Selection &sel) {
         cell->AddUndo(doc);
         cell->ResetChildren();
-        foreachcellinsel(c, sel) c->text.ReplaceStr(s, ls);
+        foreachcellinsel(c, sel) c->text.ReplaceStr(s);
         doc->UpdateLayout();
         doc->canvas->Refresh();
     }
 
-    void CSVImport(const wxArrayString &as, const wxString &sep) {
-        int cy = 0;
-        loop(y, as.size()) {
-            auto s = as[y];
-            wxString word;
-            for (int x = 0; !s.empty(); x++) {
-                if (s[0] == '\"') {
-                    word = "";
-                    for (int i = 1;; i++) {
-                        if (!s[i]) {
-                            if (y < static_cast<int>(as.size()) - 1) {
-                                // A quoted field that continues on the next line keeps the line
-                                // break that ended this one.
-                                word += LINE_SEPARATOR;
-                                s = as[++y];
-                                i = -1;
-                            } else {
-                                s = L"";
-                                break;
-                            }
-                        } else if (s[i] == '\"') {
-                            if (s[i + 1] == '\"') {
-                                word += s[++i];
-                            } else {
-                                s = s.size() == i + 1 ? wxString(L"") : s.Mid(i + 2);
-                                break;
-                            }
-                        } else {
-                            word += s[i];
-                        }
-                    }
-                } else {
-                    int pos = s.Find(sep);
-                    if (pos < 0) {
-                        word = s;
-                        s = "";
-                    } else {
-                        word = s.Left(pos);
-                        s = s.Mid(pos + 1);
-                    }
+    // Fills a grid sized to csv.numcolumns by csv.numrows. Each chunk has rows of its own, so
+    // their fields are moved into the cells in parallel.
+    void CSVImport(CSVReader &csv) {
+        ParallelFor(csv.chunks.size(), 1, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; i++) {
+                auto &chunk = csv.chunks[i];
+                auto y = static_cast<int>(chunk.firstrow);
+                size_t f = 0;
+                for (auto n : chunk.numfields) {
+                    loop(x, n) C(x, y)->text.t = std::move(chunk.fields[f++]);
+                    y++;
                 }
-                if (x >= xs) { InsertCells(x, -1, 1, 0); }
-                Cell *c = C(x, cy).get();
-                c->text.t = word;
+                vector<wxString>().swap(chunk.fields);
             }
-            cy++;
-        }
-
-        ys = cy;
-        cells.resize(xs * ys);
+        });
     }
 
     unique_ptr<Cell> EvalGridCell(Evaluator &ev, unique_ptr<Cell> &c, unique_ptr<Cell> acc, int &x,
@@ -824,7 +874,7 @@ struct Grid {
                 return acc;
             // Operation
             case CT_CODE: {
-                auto *op = ev.FindOp(c->text.t);
+                auto *op = ev.FindOp(c->text.t.Get());
                 switch (op != nullptr ? strlen(op->args) : -1) {
                     default: return nullptr;
                     case 0: return treesheets::Evaluator::Execute(op);
@@ -899,7 +949,7 @@ struct Grid {
     }
 
     void Split(vector<shared_ptr<Grid>> &gs, bool vert) {
-        loop(i, vert ? xs : ys) gs.push_back(make_unique<Grid>(vert ? 1 : xs, vert ? ys : 1));
+        loop(i, vert ? xs : ys) gs.push_back(make_pooled<Grid>(vert ? 1 : xs, vert ? ys : 1));
         foreachcell(c) {
             auto *g = gs[vert ? x : y].get();
             c->SetParent(g->cell);
@@ -921,12 +971,14 @@ struct Grid {
         vector<unique_ptr<Cell>> tr(xs * ys);
         foreachcell(c) tr[y + x * ys] = std::move(c);
         cells = std::move(tr);
+        gapy = gaprows = 0;
         swap_(xs, ys);
         SetOrient();
         // Columns that were rows have no width of their own, so they get the width of the last
         // column that did.
         auto width = colwidths.back();
         colwidths.resize(xs, width);
+        ReindexCells();
     }
 
     void Sort(Selection &sel, bool descending) {
@@ -936,7 +988,8 @@ struct Grid {
         std::stable_sort(row_indices.begin(), row_indices.end(), [&](int i, int j) {
             loop(k, xs) {
                 int col = (k + sel.x) % xs;
-                int cmp = C(col, sel.y + i)->text.t.CmpNoCase(C(col, sel.y + j)->text.t);
+                int cmp =
+                    C(col, sel.y + i)->text.t.Get().CmpNoCase(C(col, sel.y + j)->text.t.Get());
                 if (cmp) { return descending ? cmp > 0 : cmp < 0; }
             }
             return false;
@@ -951,8 +1004,9 @@ struct Grid {
         }
 
         loop(i, sel.ys * xs) {
-            cells[sel.y * xs + i] = std::move(new_cells[i]);
+            C(i % xs, sel.y + i / xs) = std::move(new_cells[i]);
         }
+        ReindexCells();
     }
 
     Cell *FindExact(const wxString &s) {
@@ -963,46 +1017,79 @@ struct Grid {
         return nullptr;
     }
 
+    // The cells FindExact() would find one after the other, in that order.
+    void CollectExact(const wxString &s, vector<Cell *> &found) {
+        foreachcell(c) {
+            if (c->text.t == s) { found.push_back(c.get()); }
+            if (c->grid) { c->grid->CollectExact(s, found); }
+        }
+    }
+
     Selection HierarchySwap(const wxString &tag) {
         Cell *selcell = nullptr;
-        bool done = false;
-    lookformore:
-        foreachcell(c) if (c->grid && !done) {
-            auto *f = c->grid->FindExact(tag);
-            if (f != nullptr) {
-                // add all parent tags as extra hierarchy inside the cell
-                for (auto *p = f->parent; p != cell; p = p->parent) {
-                    // Special case check: if parents have same name, this would cause infinite
-                    // swapping.
-                    if (p->text.t == tag) { done = true; }
-                    auto t = make_unique<Cell>(f, p);
-                    t->text = p->text;
-                    t->text.cell = t.get();
-                    t->note = p->note;
-                    t->grid = f->grid;
-                    if (t->grid) { t->grid->ReParent(t.get()); }
-                    f->grid = make_shared<Grid>(1, 1);
-                    f->grid->cell = f;
-                    f->grid->cells[0] = std::move(t);
-                }
-                // remove cell from parent, recursively if parent becomes empty
-                for (auto *r = f; r != nullptr && r != cell;
-                     r = r->parent->grid->DeleteTagParent(r, cell, f)) {};
-                // merge newly constructed hierarchy at this level
-                if (!cells[0]) {
-                    cells[0].reset(f);
-                    f->parent = cell;
-                    selcell = f;
-                } else {
-                    MergeTagCell(unique_ptr<Cell>(f), selcell);
+        // Moving a found cell up leaves the others where they were, so all of them can be
+        // collected in one walk rather than searching the whole tree again after each move.
+        // That does not hold if tags are nested, or if removing an emptied parent takes a row of
+        // a table (and maybe other found cells) with it, which the search below still handles.
+        vector<Cell *> found;
+        foreachcell(c) if (c->grid) { c->grid->CollectExact(tag, found); }
+        auto simple = xs == 1 || ys == 1;
+        for (auto *f : found) {
+            for (auto *p = f->parent; simple && p != cell; p = p->parent) {
+                auto *g = p->grid.get();
+                simple = p->text.t != tag && (g->xs == 1 || g->ys == 1);
+            }
+        }
+        if (simple) {
+            for (auto *f : found) { HierarchySwapCell(f, tag, selcell); }
+        } else {
+            bool done = false;
+        lookformore:
+            foreachcell(c) if (c->grid && !done) {
+                auto *f = c->grid->FindExact(tag);
+                if (f != nullptr) {
+                    done = HierarchySwapCell(f, tag, selcell);
+                    goto lookformore;
                 }
-                goto lookformore;
             }
         }
         ASSERT(selcell);
         return FindCell(selcell);
     }
 
+    // Moves f up to this level, with its parents below it. Returns true if one of those has
+    // the same text as f, as swapping any further would go on forever.
+    bool HierarchySwapCell(Cell *f, const wxString &tag, Cell *&selcell) {
+        bool done = false;
+        // add all parent tags as extra hierarchy inside the cell
+        for (auto *p = f->parent; p != cell; p = p->parent) {
+            // Special case check: if parents have same name, this would cause infinite
+            // swapping.
+            if (p->text.t == tag) { done = true; }
+            auto t = make_unique<Cell>(f, p);
+            t->text = p->text;
+            t->text.cell = t.get();
+            t->note = p->note;
+            t->grid = f->grid;
+            if (t->grid) { t->grid->ReParent(t.get()); }
+            f->grid = make_pooled<Grid>(1, 1);
+            f->grid->cell = f;
+            f->grid->cells[0] = std::move(t);
+        }
+        // remove cell from parent, recursively if parent becomes empty
+        for (auto *r = f; r != nullptr && r != cell;
+             r = r->parent->grid->DeleteTagParent(r, cell, f)) {};
+        // merge newly constructed hierarchy at this level
+        if (!C(0, 0)) {
+            C(0, 0).reset(f);
+            f->parent = cell;
+            selcell = f;
+        } else {
+            MergeTagCell(unique_ptr<Cell>(f), selcell);
+        }
+        return done;
+    }
+
     void ReParent(Cell *p) {
         cell = p;
         foreachcell(c) c->parent = p;
@@ -1038,28 +1125,40 @@ struct Grid {
         }
     }
 
-    void MergeTagCell(unique_ptr<Cell> f, Cell *&selcell) {
-        foreachcell(c) if (c->text.t == f->text.t) {
-            if (selcell == nullptr) { selcell = c.get(); }
+    // bytext, if given, has the cells of this grid by text and is kept up to date.
+    void MergeTagCell(unique_ptr<Cell> f, Cell *&selcell,
+                      std::unordered_map<wxString, Cell *, TextHash> *bytext = nullptr) {
+        Cell *c = nullptr;
+        if (bytext != nullptr) {
+            if (auto it = bytext->find(f->text.t.Get()); it != bytext->end()) { c = it->second; }
+        } else {
+            foreachcell(d) if (c == nullptr && d->text.t == f->text.t) { c = d.get(); }
+        }
+        if (c != nullptr) {
+            if (selcell == nullptr) { selcell = c; }
 
             if (f->grid) {
                 if (c->grid) {
-                    f->grid->MergeTagAll(c.get());
+                    f->grid->MergeTagAll(c);
                 } else {
                     c->grid = f->grid;
-                    c->grid->ReParent(c.get());
+                    c->grid->ReParent(c);
                     f->grid = nullptr;
                 }
             }
             return;
         }
         if (selcell == nullptr) { selcell = f.get(); }
+        if (bytext != nullptr) { bytext->emplace(f->text.t.Get(), f.get()); }
         Add(std::move(f));
     }
 
     void MergeTagAll(Cell *into) {
+        // Looking each cell up by text, rather than going over all of into's for each of them.
+        std::unordered_map<wxString, Cell *, TextHash> bytext;
+        foreachcellingrid(c, into->grid) bytext.emplace(c->text.t.Get(), c.get());
         foreachcell(c) {
-            into->grid->MergeTagCell(std::move(c), into /*dummy*/);
+            into->grid->MergeTagCell(std::move(c), into /*dummy*/, &bytext);
         }
     }
 
@@ -1072,47 +1171,42 @@ struct Grid {
         return true;
     }
 
-    void Hierarchify(Document *doc) {
+    void Hierarchify() {
+        // Group rows by the text of their first column, in order of first occurrence.
+        std::unordered_map<wxString, size_t, TextHash> groupof;
+        vector<vector<int>> groups;
         loop(y, ys) {
-            unique_ptr<Cell> rest;
+            auto [it, isnew] = groupof.try_emplace(C(0, y)->text.t.Get(), groups.size());
+            if (isnew) { groups.emplace_back(); }
+            groups[it->second].push_back(y);
+        }
+        // The first cell of each group gets the other columns of all rows in the group as its
+        // sub-grid, and the remaining cells are dropped. Everything is moved rather than
+        // inserted row by row, so this stays linear in the size of the table.
+        vector<unique_ptr<Cell>> ncells;
+        ncells.reserve(groups.size());
+        for (auto &rows : groups) {
+            auto &c = C(0, rows[0]);
             if (xs > 1) {
-                Selection s(cell->grid, 1, y, xs - 1, 1);
-                rest = CloneSel(s);
-            }
-            Cell *c = C(0, y).get();
-            loop(prevy, y) {
-                if (Cell *prev = C(0, prevy).get(); prev->text.t == c->text.t) {
-                    if (rest) {
-                        ASSERT(prev->grid);
-                        prev->grid->MergeRow(rest->grid.get());
-                        rest = nullptr;
-                    }
-
-                    Selection s(cell->grid, 0, y, xs, 1);
-                    if (!MultiCellDeleteSub(doc, s)) { return; }
-                    y--;
-
-                    goto done;
+                auto g = make_pooled<Grid>(xs - 1, static_cast<int>(rows.size()), c.get());
+                loop(x, xs - 1) g->colwidths[x] = colwidths[x + 1];
+                loopv(i, rows) loop(x, xs - 1) {
+                    g->C(x, i) = std::move(C(x + 1, rows[i]));
+                    g->C(x, i)->parent = c.get();
                 }
+                g->ReindexCells();
+                c->grid = g;
             }
-            if (rest) {
-                std::swap(c->grid, rest->grid);
-                c->grid->ReParent(c);
-            }
-        done:;
-        }
-        Selection s(cell->grid, 1, 0, xs - 1, ys);
-        if (!MultiCellDeleteSub(doc, s)) { return; }
-        foreachcell(c) if (c->grid && c->grid->xs > 1) { c->grid->Hierarchify(doc); }
-    }
-
-    void MergeRow(Grid *tm) {
-        ASSERT(xs == tm->xs && tm->ys == 1);
-        InsertCells(-1, ys, 0, 1);
-        loop(x, xs) {
-            std::swap(C(x, ys - 1), tm->C(x, 0));
-            C(x, ys - 1)->parent = cell;
+            ncells.push_back(std::move(c));
         }
+        cells = std::move(ncells);
+        gapy = gaprows = 0;
+        xs = 1;
+        ys = static_cast<int>(groups.size());
+        colwidths.resize(1);
+        SetOrient();
+        ReindexCells();
+        foreachcell(c) if (c->grid && c->grid->xs > 1) { c->grid->Hierarchify(); }
     }
 
     void MaxDepthLeaves(int curdepth, int &maxdepth, int &leaves) {
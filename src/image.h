@@ -55,10 +55,7 @@ struct Image {
     bool ExportToDirectory(const wxString &directory) {
         wxString targetname = directory + wxString::Format("%llu", hash) + GetFileExtension();
         wxFFileOutputStream os(targetname, "w+b");
-        if (!os.IsOk()) {
-            wxMessageBox(_("Error writing image file!"), targetname.wx_str(), wxOK, sys->frame);
-            return false;
-        }
+        if (!os.IsOk()) { return false; }
         os.Write(data.data(), data.size());
         return true;
     }
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 
-static const auto TS_VERSION = 25;
+static const auto TS_VERSION = 26;
+static const auto TS_VERSION_NO_BLANKS = 25;  // what files without TS_BLANKS are saved as
 static const auto g_grid_margin = 1;
 static const auto g_cell_margin = 2;
 static const auto g_margin_extra = 2;  // TODO, could make this configurable: 0/2/4/6
@@ -41,7 +42,12 @@ static auto g_deftextsize = g_deftextsize_default;
 static int g_mintextsize() { return g_deftextsize - g_mintextsize_delta; }
 static int g_maxtextsize() { return g_deftextsize + g_maxtextsize_delta; }
 
-enum { TS_TEXT = 0, TS_GRID = 1, TS_BOTH = 2, TS_NEITHER = 3 };
+// TS_BLANKS is a TS_NEITHER cell followed by a count of identical ones, since version 26.
+enum { TS_TEXT = 0, TS_GRID = 1, TS_BOTH = 2, TS_NEITHER = 3, TS_BLANKS = 4 };
+// Shorter runs are written cell by cell, so that most files can still be read by version 25.
+static const auto g_min_blank_run = 16;
+
+enum { SEARCH_PLAIN = 0, SEARCH_WHOLEWORD, SEARCH_REGEX, SEARCH_FUZZY };
 
 enum {
     A_SAVEALL = 500,
@@ -150,6 +156,12 @@ enum {
     A_LINKIMGREV,
     A_SEARCHNEXT,
     A_SEARCHPREV,
+    A_SEARCHRESULTS,
+    A_SEARCHPLAIN,
+    A_SEARCHWHOLEWORD,
+    A_SEARCHREGEX,
+    A_SEARCHFUZZY,
+    A_FINDINFILES,
     A_CUSTCOL,
     A_COLCELL,
     A_SORT,
@@ -265,6 +277,8 @@ enum {
     A_DEFAULTIMAGE_JPEG,
     A_DRAGANDDROP,
     A_DEFAULTMAXCOLWIDTH,
+    A_UNDOLIMITS,
+    A_UNDOJOURNAL,
     #ifdef ENABLE_LOBSTER
         A_ADDSCRIPT,
         A_DETSCRIPT,
@@ -335,7 +335,7 @@ struct Selection {
                 Dir(doc, ctrl, shift, 1, 0, x, xs, ys, x < grid->xs, x < grid->xs - 1, exitedit);
                 break;
         }
-        sys->frame->UpdateStatus(doc->selected, true);
+        sys->frame->UpdateStatus(doc, doc->selected, true);
     }
 
     void Next(Document *doc, bool backwards) {
@@ -14,6 +14,7 @@
 #include <wx/dcbuffer.h>
 #include <wx/dcgraph.h>
 #include <wx/dir.h>
+#include <wx/dirdlg.h>
 #include <wx/dnd.h>
 #include <wx/fileconf.h>
 #include <wx/numdlg.h>
@@ -42,6 +43,7 @@
 #include <wx/fontdlg.h>
 #include <wx/fswatcher.h>
 #include <wx/ipc.h>
+#include <wx/listctrl.h>
 #include <wx/mstream.h>
 #include <wx/notebook.h>
 #include <wx/odcombo.h>
@@ -66,18 +68,23 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <clocale>
 #include <condition_variable>
+#include <cwctype>
 #include <filesystem>
 #include <functional>
 #include <future>
 #include <iomanip>
+#include <limits>
 #include <locale>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <new>
+#include <numeric>
 #include <queue>
+#include <regex>
 #include <set>
 #include <sstream>
 #include <stdexcept>
@@ -85,9 +92,15 @@
 #include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define TS_SSE2
+    #include <emmintrin.h>
+#endif
+
 #ifdef __WXMAC__
     #include <mach-o/dyld.h>
     #include "macclipboard.h"
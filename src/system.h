@@ -10,11 +10,13 @@ struct System {
     wxString defaultfixedfont {"Courier New"};
     wxString defaultlang {wxEmptyString};
     wxString searchstring;
+    SearchMatcher searchmatcher;
     unique_ptr<wxConfigBase> cfg;
     wxArrayString scripts;
     Evaluator evaluator;
     wxString clipboardcopy;
-    unique_ptr<Cell> cellclipboard;
+    shared_ptr<Cell> cellclipboard;  // the copied cells, in a grid like CloneSel() makes
+    bool cellclipboardsingle {false};  // a single cell was copied, which is what gets pasted
     vector<unique_ptr<Image>> imagelist;
     vector<int> loadimageids;
     uchar versionlastloaded {0};
@@ -49,6 +51,10 @@ struct System {
     bool followdarkmode {false};
     bool innerbordercolor {false};
     bool searchfolded {true};
+    int searchmode {SEARCH_PLAIN};
+    int undomemory {100};  // MB of undo history kept in memory, older steps are moved to disk
+    int undosteps {1000};
+    bool undojournal {false};
     uint colormask {0};
     int notesizex {300};
     int notesizey {255};
@@ -66,6 +72,9 @@ struct System {
     Image *lastimage {nullptr};
     int customcolor {0xFFFFFF};
     int cursorcolor {0x00FF00};
+    // Auto-exports that may still be running, see Document::AutoExport(). Declared last, so that
+    // ~System() waits for them before anything else goes.
+    vector<std::future<void>> autoexportworkers;
 
     System(bool portable)
         : cfg(portable ? new wxFileConfig("", "", wxGetCwd() + "/TreeSheets.ini", "", 0)
@@ -99,6 +108,11 @@ struct System {
         cfg->Read("fswatch", &fswatch, fswatch);
         cfg->Read("casesensitivesearch", &casesensitivesearch, casesensitivesearch);
         cfg->Read("searchfolded", &searchfolded, searchfolded);
+        cfg->Read("undomemory", &undomemory, undomemory);
+        cfg->Read("undosteps", &undosteps, undosteps);
+        cfg->Read("undojournal", &undojournal, undojournal);
+        searchmode = std::clamp(static_cast<int>(cfg->Read("searchmode", searchmode)),
+                                static_cast<int>(SEARCH_PLAIN), static_cast<int>(SEARCH_FUZZY));
         cfg->Read("defaultfontsize", &g_deftextsize_default, g_deftextsize_default);
         g_deftextsize = g_deftextsize_default;
         cfg->Read("customcolor", &customcolor, customcolor);
@@ -185,7 +199,7 @@ struct System {
 
     unique_ptr<Cell> &InitDB(int sizex, int sizey = 0) const {
         unique_ptr<Cell> c = make_unique<Cell>(
-            nullptr, nullptr, CT_DATA, make_shared<Grid>(sizex, sizey != 0 ? sizey : sizex));
+            nullptr, nullptr, CT_DATA, make_pooled<Grid>(sizex, sizey != 0 ? sizey : sizex));
         c->cellcolor = 0xCCDCE2;
         c->grid->InitCells();
         auto *doc = NewTabDoc();
@@ -340,12 +354,13 @@ struct System {
                             for (;;) {
                                 auto tag = dis.ReadString();
                                 if (tag.IsEmpty()) { break; }
-                                doc->tags[tag] =
-                                    versionlastloaded >= 24 ? dis.Read32() : g_tagcolor_default;
+                                doc->AddTag(tag, versionlastloaded >= 24 ? dis.Read32()
+                                                                         : g_tagcolor_default);
                             }
                         }
 
                         doc->InitWith(std::move(root), filename, ics, xs, ys);
+                        if (!loadedfromtmp) { doc->ReplayJournal(); }
 
                         auto end_loading_time = wxGetLocalTimeMillis();
 
@@ -400,6 +415,196 @@ struct System {
         return _("Open file cancelled.");
     }
 
+    struct FileHit {
+        wxString filename;
+        vector<pair<int, int>> path;
+        wxString label;
+    };
+
+    // Moves fis past a JPEG stream by following its markers, since decoding it with wxImage
+    // isn't safe off the main thread.
+    static bool SkipJPEG(wxInputStream &fis) {
+        auto byte = [&]() {
+            auto c = fis.GetC();
+            return fis.LastRead() == 1 ? c : -1;
+        };
+        if (byte() != 0xFF || byte() != 0xD8) { return false; }  // SOI
+        auto marker = -1;  // already read by the entropy coded data loop
+        for (;;) {
+            if (marker < 0) {
+                if (byte() != 0xFF) { return false; }
+                marker = byte();
+            }
+            while (marker == 0xFF) { marker = byte(); }  // fill bytes
+            auto m = marker;
+            marker = -1;
+            if (m < 0) { return false; }
+            if (m == 0xD9) { return true; }                        // EOI
+            if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) { continue; }  // no length
+            auto hi = byte();
+            auto lo = byte();
+            if (hi < 0 || lo < 0 || (hi << 8 | lo) < 2) { return false; }
+            fis.SeekI((hi << 8 | lo) - 2, wxFromCurrent);
+            if (m != 0xDA) { continue; }
+            // After SOS, the image data runs to the next marker that isn't a stuffed 0xFF or
+            // a restart.
+            for (;;) {
+                auto c = byte();
+                if (c < 0) { return false; }
+                if (c != 0xFF) { continue; }
+                auto n = byte();
+                while (n == 0xFF) { n = byte(); }
+                if (n < 0) { return false; }
+                if (n == 0 || (n >= 0xD0 && n <= 0xD7)) { continue; }
+                marker = n;
+                break;
+            }
+        }
+    }
+
+    // Collects the cells of a .cts file matching matcher, without loading it as a document.
+    // Runs on worker threads, so everything the file header affects is kept local.
+    static wxString ScanFile(const wxString &filename, const SearchMatcher &matcher,
+                             bool withfolded, vector<FileHit> &hits) {
+        wxFFileInputStream fis(filename);
+        wxDataInputStream dis(fis);
+        if (!fis.IsOk()) { return _("Cannot open file."); }
+        char buf[4];
+        fis.Read(buf, 4);
+        if (fis.LastRead() != 4 || strncmp(buf, "TSFF", 4) != 0) {
+            return _("Not a TreeSheets file.");
+        }
+        uchar version = 0;
+        fis.Read(&version, 1);
+        if (version > TS_VERSION) { return _("File of newer version."); }
+        if (version >= 21) {
+            dis.Read8();
+            dis.Read8();
+        }
+        if (version >= 23) { dis.Read8(); }
+        for (;;) {
+            fis.Read(buf, 1);
+            if (fis.LastRead() != 1) { return _("File corrupted!"); }
+            switch (*buf) {
+                case 'I':
+                case 'J': {
+                    // Skip over image data, same layout as in LoadDB.
+                    if (version < 9) { dis.ReadString(); }
+                    if (version >= 19) { dis.ReadDouble(); }
+                    if (version >= 22) {
+                        fis.SeekI(static_cast<wxFileOffset>(dis.Read64()), wxFromCurrent);
+                    } else if (*buf == 'I') {
+                        fis.SeekI(8, wxFromCurrent);  // PNG header
+                        dis.BigEndianOrdered(true);
+                        for (;;) {
+                            wxInt32 len = dis.Read32();
+                            char fourcc[4];
+                            fis.Read(fourcc, 4);
+                            fis.SeekI(len + 4, wxFromCurrent);  // data + CRC
+                            if (!fis.IsOk() || memcmp(fourcc, "IEND", 4) == 0) { break; }
+                        }
+                        dis.BigEndianOrdered(false);
+                    } else if (!SkipJPEG(fis)) {
+                        return _("JPEG file is corrupted!");
+                    }
+                    if (!fis.IsOk()) { return _("File corrupted!"); }
+                    break;
+                }
+                case 'D': {
+                    wxZlibInputStream zis(fis);
+                    if (!zis.IsOk()) { return _("Cannot decompress file."); }
+                    wxDataInputStream zdis(zis);
+                    auto found = [&](const wxString &t, const vector<pair<int, int>> &p,
+                                     const vector<wxString> &ps) {
+                        size_t len = 0;
+                        auto pos = matcher.Find(t, 0, len);
+                        if (pos < 0 || p.empty()) { return; }
+                        auto label = wxFileName(filename).GetFullName() + ": ";
+                        // ps[0] is the root, which is never shown.
+                        for (size_t i = 1; i < ps.size(); i++) {
+                            label += ps[i].BeforeFirst('\n').Left(40) + " > ";
+                        }
+                        hits.push_back({filename, p,
+                                        label + SearchResultsPanel::ContextText(t, pos, len)});
+                    };
+                    if (!Cell::ScanWhich(zdis, version, withfolded, found)) {
+                        return _("File corrupted!");
+                    }
+                    return wxEmptyString;
+                }
+                default: return _("Corrupt block header.");
+            }
+        }
+    }
+
+    wxString FindInFiles(const wxString &directory) {
+        if (searchmatcher.IsEmpty()) { return _("Please enter something to search for first."); }
+        wxArrayString filenames;
+        wxDir::GetAllFiles(directory, &filenames, "*.cts");
+        if (filenames.IsEmpty()) { return _("No TreeSheets files found in this folder."); }
+        vector<vector<FileHit>> filehits(filenames.size());
+        vector<wxString> errors(filenames.size());
+        {
+            wxBusyCursor wait;
+            ParallelFor(filenames.size(), 1, [&](size_t begin, size_t end) {
+                for (auto i = begin; i < end; i++) {
+                    errors[i] = ScanFile(filenames[i], searchmatcher, searchfolded, filehits[i]);
+                }
+            });
+        }
+        // Files that couldn't be searched shouldn't look like files without matches.
+        const int maxlisted = 10;
+        auto numfailed = 0;
+        wxString failed;
+        loopv(i, errors) {
+            if (errors[i].IsEmpty()) { continue; }
+            if (numfailed++ < maxlisted) { failed += filenames[i] + ": " + errors[i] + "\n"; }
+        }
+        if (numfailed > maxlisted) {
+            failed += wxString::Format(_("... and %d more."), numfailed - maxlisted);
+        }
+        if (numfailed > 0) {
+            wxMessageBox(failed, _("Some files could not be searched"), wxOK | wxICON_WARNING,
+                         frame);
+        }
+        auto numscanned = static_cast<int>(filenames.size()) - numfailed;
+        vector<FileHit> hits;
+        wxArrayString labels;
+        for (auto &fh : filehits) {
+            for (auto &hit : fh) {
+                labels.Add(hit.label);
+                hits.push_back(std::move(hit));
+            }
+        }
+        if (hits.empty()) {
+            return wxString::Format(_("No matches in %d file(s)."), numscanned);
+        }
+        wxSingleChoiceDialog choice(
+            frame,
+            wxString::Format(_("%d match(es) in %d file(s), pick one to open:"),
+                             static_cast<int>(hits.size()), numscanned),
+            _("Find in files"), labels);
+        choice.SetSize(wxSize(700, 500));
+        choice.Centre();
+        if (choice.ShowModal() != wxID_OK) { return wxEmptyString; }
+        auto &hit = hits[choice.GetSelection()];
+        if (auto message = Open(hit.filename); !message.IsEmpty()) { return message; }
+        auto *canvas = frame->GetTabByFileName(hit.filename);
+        if (canvas == nullptr) { return wxEmptyString; }
+        auto *doc = canvas->doc.get();
+        // The file may have changed since it was scanned (or an autosave may have been loaded
+        // instead), so stop at whatever part of the path still exists.
+        Cell *c = doc->root.get();
+        for (auto [x, y] : hit.path) {
+            if (!c->grid || x >= c->grid->xs || y >= c->grid->ys) { break; }
+            c = c->grid->C(x, y).get();
+        }
+        if (c->parent == nullptr) { return wxEmptyString; }
+        doc->SetSelect(c->parent->grid->FindCell(c));
+        doc->ScrollOrZoom(true);
+        return wxEmptyString;
+    }
+
     void RememberOpenFiles() const {
         cfg->Write("lastopenfile", frame->GetCurrentTab()->doc->filename);
         auto namedfiles = 0;
@@ -435,6 +640,13 @@ struct System {
         }
     #endif
 
+    wxString SetSearch(const wxString &query) {
+        searchstring = query;
+        auto error = searchmatcher.Compile(query, searchmode, casesensitivesearch);
+        darkennonmatchingcells = !searchmatcher.IsEmpty();
+        return error;
+    }
+
     void SaveCheck() const {
         loop(i, frame->notebook->GetPageCount()) {
             dynamic_cast<TSCanvas *>(frame->notebook->GetPage(i))
@@ -455,6 +667,23 @@ struct System {
             switch (action) {
                 case A_IMPXML:
                 case A_IMPXMLA: {
+                    wxFFileInputStream fis(filename);
+                    if (!fis.IsOk()) { goto problem; }
+                    XMLReader xml(fis);
+                    if (xml.IsSupported()) {
+                        auto c = ReadXML(xml, action == A_IMPXMLA);
+                        if (!c) { goto problem; }
+                        unique_ptr<Cell> &root = InitDB(1);
+                        if (!c->HasText() && c->grid) {
+                            root = std::move(c);
+                        } else {
+                            c->parent = root.get();
+                            root->grid->C(0, 0) = std::move(c);
+                            root->grid->ReindexCells();
+                        }
+                        break;
+                    }
+                    // Only the DOM parser knows about the encodings that aren't ASCII based.
                     wxXmlDocument doc;
                     if (!doc.Load(filename)) { goto problem; }
                     unique_ptr<Cell> &root = InitDB(1);
@@ -467,34 +696,24 @@ struct System {
                     }
                     break;
                 }
-                case A_IMPTXTI:
-                case A_IMPTXTC:
-                case A_IMPTXTS:
-                case A_IMPTXTT: {
+                case A_IMPTXTI: {
                     wxFFile file(filename);
                     if (!file.IsOpened()) { goto problem; }
                     wxString content;
                     if (!file.ReadAll(&content)) { goto problem; }
-                    const auto &lines = wxStringTokenize(content, LINE_DELIMITERS);
-
-                    if (!lines.empty()) {
-                        switch (action) {
-                            case A_IMPTXTI: {
-                                FillRows(InitDB(1)->grid.get(), lines, CountCol(lines[0]), 0, 0);
-                            }; break;
-                            case A_IMPTXTC:
-                                InitDB(1, static_cast<int>(lines.size()))
-                                    ->grid->CSVImport(lines, L',');
-                                break;
-                            case A_IMPTXTS:
-                                InitDB(1, static_cast<int>(lines.size()))
-                                    ->grid->CSVImport(lines, L';');
-                                break;
-                            case A_IMPTXTT:
-                                InitDB(1, static_cast<int>(lines.size()))
-                                    ->grid->CSVImport(lines, L'\t');
-                                break;
-                        }
+                    FillIndented(content,
+                                 [&](int rows) { return InitDB(1, rows)->grid.get(); });
+                    break;
+                }
+                case A_IMPTXTC:
+                case A_IMPTXTS:
+                case A_IMPTXTT: {
+                    CSVReader csv(action == A_IMPTXTC ? ',' : action == A_IMPTXTS ? ';' : '\t');
+                    if (!csv.Read(filename)) { goto problem; }
+                    csv.Parse();
+                    if (csv.numrows > 0) {
+                        InitDB(csv.numcolumns, static_cast<int>(csv.numrows))
+                            ->grid->CSVImport(csv);
                     }
                     break;
                 }
@@ -528,10 +747,13 @@ struct System {
         return nodes.size() + (attributes != nullptr ? attributes->size() : 0);
     }
 
-    static uint ParseColorAttribute(wxXmlNode *node, const wxString &name, uint def) {
+    static uint ParseColor(const wxString &value, uint def) {
         unsigned long color = 0;
-        return node->GetAttribute(name, wxEmptyString).ToULong(&color, 0) ? static_cast<uint>(color)
-                                                                         : def;
+        return value.ToULong(&color, 0) ? static_cast<uint>(color) : def;
+    }
+
+    static uint ParseColorAttribute(wxXmlNode *node, const wxString &name, uint def) {
+        return ParseColor(node->GetAttribute(name, wxEmptyString), def);
     }
 
     void FillXML(Cell *c, wxXmlNode *node, bool attributestoo) {
@@ -590,6 +812,167 @@ struct System {
         }
     }
 
+    // An element read by ReadXML(), and what FillXML() would have made of it so far: its cell has
+    // the text and the style, the children are added once the element is complete.
+    struct XMLElement {
+        wxString name;
+        unique_ptr<Cell> cell;
+        bool styled {false};  // this or an element folded into it was a <cell>
+        bool hastext {false};
+        bool built {false};
+        bool folded {false};
+        uint bordercolor {g_bordercolor_default};
+        int outerspacing {g_usergridouterspacing_default};
+        vector<wxString> attributes;  // their values, if those become cells too
+        vector<XMLElement> children;
+    };
+
+    // Builds the same cells as FillXML(), but from parser events rather than a DOM. Cells are
+    // made bottom up: an element's children are complete cells by the time it ends, so only the
+    // elements that are still open are held. The one exception are <row>s, which keep their
+    // children apart until their parent knows whether it is a grid made of nothing but rows.
+    static unique_ptr<Cell> ReadXML(XMLReader &xml, bool attributestoo) {
+        vector<XMLElement> open;
+        for (;;) {
+            switch (xml.Next()) {
+                case XMLReader::XML_START: {
+                    XMLElement e;
+                    e.name = xml.name;
+                    e.cell = make_unique<Cell>();
+                    auto *c = e.cell.get();
+                    // A new grid's cells take their style from its cell, which comes from the
+                    // nearest <cell> around them.
+                    if (!open.empty()) {
+                        auto *p = open.back().cell.get();
+                        c->text.relsize = p->text.relsize;
+                        c->CloneStyleFrom(p);
+                    }
+                    if (e.name == "cell") {
+                        c->text.relsize = -wxAtoi(xml.Attribute("relsize", "0"));
+                        c->text.stylebits = wxAtoi(xml.Attribute("stylebits", "0"));
+                        c->cellcolor =
+                            ParseColor(xml.Attribute("colorbg", ""), g_cellcolor_default);
+                        c->textcolor =
+                            ParseColor(xml.Attribute("colorfg", ""), g_textcolor_default);
+                        c->celltype = wxAtoi(xml.Attribute("type", "0"));
+                        e.styled = true;
+                    }
+                    e.folded = wxAtoi(xml.Attribute("folded", "0")) != 0;
+                    e.bordercolor =
+                        ParseColor(xml.Attribute("bordercolor", ""), g_bordercolor_default);
+                    e.outerspacing = std::clamp(
+                        wxAtoi(xml.Attribute("outerspacing",
+                                             wxString() << g_usergridouterspacing_default)),
+                        0, g_max_grid_outer_spacing);
+                    if (attributestoo) {
+                        for (auto &[key, value] : xml.attributes) { e.attributes.push_back(value); }
+                    }
+                    open.push_back(std::move(e));
+                    break;
+                }
+                case XMLReader::XML_TEXT: {
+                    // Like wxXmlNode::GetNodeContent(), only the first text counts.
+                    if (open.empty() || open.back().hastext ||
+                        xml.text.find_first_not_of(" \t\r\n") == wxString::npos) {
+                        break;
+                    }
+                    auto &e = open.back();
+                    e.hastext = true;
+                    const auto &words = wxStringTokenize(xml.text);
+                    loop(i, words.GetCount()) {
+                        if (!e.cell->text.t.IsEmpty()) { e.cell->text.t.Append(L' '); }
+                        e.cell->text.t.Append(words[i]);
+                    }
+                    break;
+                }
+                case XMLReader::XML_END: {
+                    if (open.empty() || open.back().name != xml.name) { return nullptr; }
+                    auto e = std::move(open.back());
+                    open.pop_back();
+                    if (e.name != "row" || open.empty()) { BuildXMLCell(e); }
+                    if (open.empty()) { return std::move(e.cell); }
+                    open.back().children.push_back(std::move(e));
+                    break;
+                }
+                default: return nullptr;
+            }
+        }
+    }
+
+    // FillXML() for an element whose children are complete.
+    static void BuildXMLCell(XMLElement &e) {
+        e.built = true;
+        auto *c = e.cell.get();
+        auto &nodes = e.children;
+        auto numrows = static_cast<int>(nodes.size() + e.attributes.size());
+        if (nodes.size() == 1 && nodes[0].name != "row") {
+            // The single child folds into this cell.
+            auto &child = nodes[0];
+            auto *cc = child.cell.get();
+            if (!cc->text.t.IsEmpty()) {
+                if (!c->text.t.IsEmpty()) { c->text.t.Append(L' '); }
+                c->text.t.Append(cc->text.t.Get());
+            }
+            if (child.styled) {
+                c->text.relsize = cc->text.relsize;
+                c->CloneStyleFrom(cc);
+                c->celltype = cc->celltype;
+                e.styled = true;
+            }
+            if (cc->grid) {
+                c->grid = std::move(cc->grid);
+                c->grid->ReParent(c);
+            }
+        } else if (e.name == "grid" &&
+                   std::all_of(nodes.begin(), nodes.end(),
+                               [](const XMLElement &n) { return n.name == "row"; })) {
+            if (!nodes.empty()) {
+                auto xs = max(1, static_cast<int>(nodes[0].children.size()));
+                auto *g = AddXMLGrid(e, xs, static_cast<int>(nodes.size()));
+                loopv(y, nodes) loop(x, xs) {
+                    auto &row = nodes[y].children;
+                    if (x < row.size()) {
+                        PlaceXMLCell(g, x, y, row[x]);
+                    } else {
+                        SetXMLCell(g, x, y, make_unique<Cell>(c, c));
+                    }
+                }
+            }
+        } else if (numrows > 0) {
+            auto *g = AddXMLGrid(e, 1, numrows);
+            loopv(i, e.attributes) {
+                auto attribute = make_unique<Cell>(c, c);
+                attribute->text.t = std::move(e.attributes[i]);
+                SetXMLCell(g, 0, i, std::move(attribute));
+            }
+            loopv(i, nodes) PlaceXMLCell(g, 0, i + static_cast<int>(e.attributes.size()), nodes[i]);
+        }
+        nodes.clear();
+        e.attributes.clear();
+    }
+
+    // Like Cell::AddGrid(), but with the settings of e. The cells are left empty, for
+    // PlaceXMLCell() and SetXMLCell() to fill in.
+    static Grid *AddXMLGrid(XMLElement &e, int xs, int ys) {
+        auto *c = e.cell.get();
+        c->grid = make_pooled<Grid>(xs, ys, c);
+        c->grid->folded = e.folded;
+        c->grid->bordercolor = e.bordercolor;
+        c->grid->user_grid_outer_spacing = e.outerspacing;
+        return c->grid.get();
+    }
+
+    static void PlaceXMLCell(Grid *g, int x, int y, XMLElement &e) {
+        if (!e.built) { BuildXMLCell(e); }
+        SetXMLCell(g, x, y, std::move(e.cell));
+    }
+
+    static void SetXMLCell(Grid *g, int x, int y, unique_ptr<Cell> c) {
+        c->parent = g->cell;
+        c->slot = g->Index(x, y);
+        g->C(x, y) = std::move(c);
+    }
+
     static void SetGridSettingsFromXML(Cell *c, wxXmlNode *node) {
         c->grid->folded = wxAtoi(node->GetAttribute("folded", "0")) != 0;
         c->grid->bordercolor = ParseColorAttribute(node, "bordercolor", g_bordercolor_default);
@@ -598,32 +981,82 @@ struct System {
             0, g_max_grid_outer_spacing);
     }
 
-    static int CountCol(const wxString &s) {
+    // Calls f(begin, end) for every line of content that isn't empty. If f returns a bool, stops
+    // as soon as that is false.
+    template<typename F> static void ForEachLine(const wxString &content, F f) {
+        auto end = content.end();
+        for (auto it = content.begin(); it != end;) {
+            if (*it == '\r' || *it == '\n') {
+                ++it;
+                continue;
+            }
+            auto begin = it;
+            while (it != end && *it != '\r' && *it != '\n') { ++it; }
+            if constexpr (std::is_void_v<decltype(f(begin, it))>) {
+                f(begin, it);
+            } else if (!f(begin, it)) {
+                return;
+            }
+        }
+    }
+
+    // Moves it past the spaces and tabs a line starts with, and returns how many there were.
+    static int Indentation(wxString::const_iterator &it, wxString::const_iterator end) {
         auto col = 0;
-        while (s[col] == ' ' || s[col] == '\t') { col++; }
+        for (; it != end && (*it == ' ' || *it == '\t'); ++it) { col++; }
         return col;
     }
 
-    int FillRows(Grid *g, const wxArrayString &as, int column, int startrow, int starty) {
-        auto y = starty;
-        for (int i = startrow, n = as.size(); i < n; i++) {
-            auto s = as[i];
-            auto col = CountCol(s);
-            if (col < column && startrow != 0) { return i; }
-            if (col > column) {
-                auto *c = g->C(0, y - 1).get();
-                auto *sg = c->grid.get();
-                i = FillRows(sg != nullptr ? sg : c->AddGrid(), as, col, i,
-                             sg != nullptr ? sg->ys : 0) -
-                    1;
-            } else {
-                if (g->ys <= y) { g->InsertCells(-1, y, 0, 1); }
-                auto &t = g->C(0, y)->text;
-                t.t = s.Trim(false);
-                y++;
+    // Every line becomes a cell, in the grid of the last line above it that is indented less.
+    // Lines indented less than the first one still go at the top level. The first pass finds
+    // where each line goes and how many children each line has, so that the second can make
+    // every grid at its final size and only has to put the text in. The top level grid comes
+    // from toplevel(rows).
+    template<typename F> static void FillIndented(const wxString &content, F toplevel) {
+        struct Level {
+            int parent;  // line + 1, or 0 for the top level
+            int column;
+            int last;  // the line + 1 added here last, the parent of a deeper line
+        };
+        vector<Level> levels;
+        vector<int> parents;
+        vector<int> rows;
+        vector<int> numchildren(1, 0);
+        ForEachLine(content, [&](wxString::const_iterator begin, wxString::const_iterator end) {
+            auto col = Indentation(begin, end);
+            if (levels.empty()) { levels.push_back({0, col, 0}); }
+            for (;;) {
+                auto &level = levels.back();
+                if (col < level.column && levels.size() > 1) {
+                    levels.pop_back();
+                } else if (col > level.column) {
+                    levels.push_back({level.last, col, 0});
+                } else {
+                    break;
+                }
             }
-        }
-        return static_cast<int>(as.size());
+            auto &level = levels.back();
+            parents.push_back(level.parent);
+            rows.push_back(numchildren[level.parent]++);
+            numchildren.push_back(0);
+            level.last = static_cast<int>(parents.size());
+        });
+        if (parents.empty()) { return; }
+
+        vector<Cell *> cells(parents.size() + 1, nullptr);
+        Grid *top = toplevel(numchildren[0]);
+        size_t i = 0;
+        ForEachLine(content, [&](wxString::const_iterator begin, wxString::const_iterator end) {
+            Indentation(begin, end);
+            while (begin != end && wxIsspace(*begin)) { ++begin; }
+            auto *p = cells[parents[i]];
+            auto *g = p == nullptr ? top
+                      : p->grid    ? p->grid.get()
+                                   : p->AddGrid(1, numchildren[parents[i]]);
+            auto *c = g->C(0, rows[i]).get();
+            c->text.t = wxString(begin, end);
+            cells[++i] = c;
+        });
     }
 
     int AddImageToList(double scale, vector<uint8_t> &&data, char type) {
@@ -649,14 +1082,20 @@ struct System {
         loop(i, frame->notebook->GetPageCount()) {
             auto *doc = dynamic_cast<TSCanvas *>(frame->notebook->GetPage(i))->doc.get();
             if (doc->root) { doc->root->ImageRefCount(true); }
-            for (auto &undoitem : doc->undolist) { undoitem->clone->ImageRefCount(true); }
-            for (auto &redoitem : doc->redolist) { redoitem->clone->ImageRefCount(true); }
+            for (auto &undoitem : doc->undolist) { undoitem->ImageRefCount(); }
+            for (auto &redoitem : doc->redolist) { redoitem->ImageRefCount(); }
+            doc->undospill.ImageRefCount();
         }
         if (cellclipboard) { cellclipboard->ImageRefCount(true); }
         if (lastimage != nullptr) { lastimage->trefc++; }
         std::erase_if(imagelist, [](const unique_ptr<Image> &image) { return image->trefc == 0; });
     }
 
+    Cell *ClipboardCell() const {
+        if (!cellclipboard) { return nullptr; }
+        return cellclipboardsingle ? cellclipboard->grid->C(0, 0).get() : cellclipboard.get();
+    }
+
     static void ImageSize(wxBitmap *bm, int &xs, int &ys) {
         if (bm == nullptr) { return; }
         xs = bm->GetLogicalWidth();  // returns GetWidth on wxMSW
@@ -1,14 +1,174 @@
+// The current search query, compiled once whenever it or the search options change rather than
+// for every cell it is matched against. It is not modified while matching, so it can be shared
+// between threads.
+struct SearchMatcher {
+    wxString query;  // lowercased when searching case-insensitively, except for regexes
+    int mode {SEARCH_PLAIN};
+    bool casesensitive {true};
+    bool valid {false};
+    std::wregex regex;
+
+    // Returns an error message if the query can't be used.
+    wxString Compile(const wxString &q, int m, bool cs) {
+        mode = m;
+        casesensitive = cs;
+        valid = false;
+        query = casesensitive || mode == SEARCH_REGEX ? q : q.Lower();
+        if (query.IsEmpty()) { return wxEmptyString; }
+        if (mode == SEARCH_REGEX) {
+            auto flags = std::regex_constants::ECMAScript | std::regex_constants::optimize;
+            if (!casesensitive) { flags |= std::regex_constants::icase; }
+            try {
+                regex.assign(query.ToStdWstring(), flags);
+            } catch (const std::regex_error &) {
+                return _("Invalid regular expression.");
+            }
+        }
+        valid = true;
+        return wxEmptyString;
+    }
+
+    bool IsEmpty() const { return !valid; }
+
+    wchar_t Fold(wchar_t c) const { return casesensitive ? c : FoldCase(c); }
+
+    static bool IsWordChar(wchar_t c) { return iswalnum(c) || c == '_'; }
+
+    int FindText(const wxString &t, size_t start) const {
+        if (casesensitive) {
+            auto pos = t.find(query, start);
+            return pos == wxString::npos ? -1 : static_cast<int>(pos);
+        }
+        auto pos =
+            FindFolded(t.wc_str() + start, t.length() - start, query.wc_str(), query.length());
+        return pos < 0 ? -1 : pos + static_cast<int>(start);
+    }
+
+    // Position of the first match in t at or after start, or -1. len is set to the length of
+    // the match.
+    int Find(const wxString &t, size_t start, size_t &len) const {
+        if (!valid || start > t.length()) { return -1; }
+        auto *s = t.wc_str();
+        switch (mode) {
+            case SEARCH_WHOLEWORD:
+                for (int pos; (pos = FindText(t, start)) >= 0; start = pos + 1) {
+                    auto end = pos + query.length();
+                    if ((pos == 0 || !IsWordChar(s[pos - 1])) &&
+                        (end == t.length() || !IsWordChar(s[end]))) {
+                        len = query.length();
+                        return pos;
+                    }
+                }
+                return -1;
+            case SEARCH_REGEX: {
+                std::wcmatch m;
+                auto pos = FindRegex(s, t.length(), start, m);
+                if (pos >= 0) { len = m.length(0); }
+                return pos;
+            }
+            case SEARCH_FUZZY: {
+                // All characters of the query in order, with anything in between. Find where the
+                // leftmost such match ends, then walk back to the tightest start for that end.
+                size_t qi = 0;
+                size_t end = start;
+                for (; end < t.length() && qi < query.length(); end++) {
+                    if (Fold(s[end]) == query[qi]) { qi++; }
+                }
+                if (qi < query.length()) { return -1; }
+                auto begin = end;
+                while (qi > 0) {
+                    if (Fold(s[--begin]) == query[qi - 1]) { qi--; }
+                }
+                len = end - begin;
+                return static_cast<int>(begin);
+            }
+            default: len = query.length(); return FindText(t, start);
+        }
+    }
+
+    // std::regex matches recursively, one stack frame or more per character it consumes, so a
+    // pattern like (a|b)* overflows the stack of a search thread on a long cell. Matches are
+    // instead looked for in overlapping windows of at most REGEX_WINDOW characters, which only
+    // misses matches longer than REGEX_WINDOW / 2 that straddle a window boundary.
+    static constexpr size_t REGEX_WINDOW = 512;
+
+    // Position of the first match in s[0, n) at or after start, or -1, with the match in m.
+    int FindRegex(const wchar_t *s, size_t n, size_t start, std::wcmatch &m) const {
+        for (auto from = start; from < n || from == start; from += REGEX_WINDOW / 2) {
+            auto to = min(from + REGEX_WINDOW, n);
+            auto flags = std::regex_constants::match_default;
+            if (from > 0) { flags |= std::regex_constants::match_prev_avail; }
+            if (to < n) {
+                flags |= std::regex_constants::match_not_eol | std::regex_constants::match_not_eow;
+            }
+            try {
+                if (std::regex_search(s + from, s + to, m, regex, flags)) {
+                    return static_cast<int>(from + m.position(0));
+                }
+            } catch (const std::regex_error &) {
+                return -1;  // error_complexity or error_stack: treat as no match
+            }
+            if (to == n) { break; }
+        }
+        return -1;
+    }
+
+    bool Matches(const wxString &t) const {
+        size_t len = 0;
+        return Find(t, 0, len) >= 0;
+    }
+
+    // Replaces every match in t, returns whether there were any. In regex mode, $1 etc. in str
+    // refer to capture groups.
+    bool ReplaceAll(wxString &t, const wxString &str) const {
+        if (!Matches(t)) { return false; }
+        if (mode == SEARCH_REGEX) {
+            auto *s = t.wc_str();
+            auto format = str.ToStdWstring();
+            wxString result;
+            size_t done = 0;
+            std::wcmatch m;
+            for (int pos; done <= t.length() && (pos = FindRegex(s, t.length(), done, m)) >= 0;) {
+                result.append(s + done, pos - done);
+                try {
+                    result += m.format(format);
+                } catch (const std::regex_error &) {
+                    return false;
+                }
+                done = pos + m.length(0);
+                // Like std::regex_replace, step over an empty match instead of repeating it.
+                if (m.length(0) == 0) {
+                    if (done == t.length()) { break; }
+                    result += s[done++];
+                }
+            }
+            if (done < t.length()) { result.append(s + done, t.length() - done); }
+            t = result;
+            return true;
+        }
+        size_t len = 0;
+        for (int i = 0; (i = Find(t, i, len)) >= 0;) {
+            t.replace(i, len, str);
+            i += str.Len();
+        }
+        return true;
+    }
+};
+
 struct Text {
     Cell *cell {nullptr};
     Image *image {nullptr};
-    wxString t {wxEmptyString};
+    CompactString t;
     int relsize {0};
     int stylebits {0};
     int extent {0};
-    wxDateTime lastedit;
     bool filtered {false};
+    wxDateTime lastedit;
 
-    void WasEdited() { lastedit = wxDateTime::Now(); }
+    void WasEdited() {
+        lastedit = wxDateTime::Now();
+        if (cell != nullptr) { cell->tagstamp = -1; }
+    }
 
     Text() { WasEdited(); }
 
@@ -19,11 +179,11 @@ struct Text {
 
     size_t EstimatedMemoryUse() const {
         ASSERT(wxUSE_UNICODE);
-        return sizeof(Text) + t.Length() * sizeof(wchar_t);
+        return sizeof(Text) + t.HeapBytes();
     }
 
     double GetNum() const {
-        std::wstringstream ss(t.ToStdWstring());
+        std::wstringstream ss(t.Get().ToStdWstring());
         double r = NAN;
         ss >> r;
         return r;
@@ -53,8 +213,8 @@ struct Text {
         return str;
     }
 
-    wxString ToText(int indent, const Selection &s, int format) const {
-        wxString str = s.cursor != s.cursorend ? t.Mid(s.cursor, s.cursorend - s.cursor) : t;
+    wxString ToText(int indent, const Selection &s, int format, double dipscale = 1.0) const {
+        wxString str = s.cursor != s.cursorend ? t.Mid(s.cursor, s.cursorend - s.cursor) : t.Get();
         if (format == A_EXPTEXT && image != nullptr) str.Append(" ");
         if (format == A_EXPXML || format == A_EXPHTMLT || format == A_EXPHTMLTI ||
             format == A_EXPHTMLTE || format == A_EXPHTMLO || format == A_EXPHTMLB) {
@@ -65,7 +225,7 @@ struct Text {
                         wxBase64Encode(image->data.data(), image->data.size()) + "\" />");
         } else if (format == A_EXPHTMLTE && image != nullptr) {
             wxString relsize = wxString::Format(
-                "%d%%", static_cast<int>(100.0 * sys->frame->FromDIP(1.0) / image->display_scale));
+                "%d%%", static_cast<int>(100.0 * dipscale / image->display_scale));
             str.Prepend("<img src=\"" + wxString::Format("%llu", image->hash) +
                         image->GetFileExtension() + "\" width=\"" + relsize + "\" height=\"" +
                         relsize + "\" />");
@@ -87,7 +247,8 @@ struct Text {
         auto startpos = currentpos;
         currentpos = breakpos;
 
-        for (auto j = t.begin() + startpos; (j != t.end()) && !wxIsspace(*j) && !IsWord(*j); j++) {
+        for (auto j = static_cast<size_t>(startpos);
+             j < t.Len() && !wxIsspace(t[j]) && !IsWord(t[j]); j++) {
             currentpos++;
             breakpos++;
         }
@@ -98,7 +259,7 @@ struct Text {
             breakpos++;
         }  // special case: if punctuation followed by quote, quote is meant to be part of word
 
-        for (auto k = t.begin() + currentpos; (k != t.end()) && wxIsspace(*k); k++) {
+        for (auto k = static_cast<size_t>(currentpos); k < t.Len() && wxIsspace(t[k]); k++) {
             // gobble spaces, but do not copy them
             currentpos++;
             if (currentpos == limitpos) {
@@ -124,7 +285,7 @@ struct Text {
 
         if (i == 0 && l <= maxcolwidth) {
             i = l;
-            return t;
+            return t.Get();
         }  // subsumed by the case below, but this case happens 90% of the time, so more optimal
         if (l - i <= maxcolwidth) { return GetLinePart(i, l, l); }
 
@@ -168,9 +329,7 @@ struct Text {
     }
 
     bool IsInSearch() const {
-        return !sys->searchstring.IsEmpty() &&
-               (sys->casesensitivesearch ? t.Find(sys->searchstring)
-                                         : t.Lower().Find(sys->searchstring)) >= 0;
+        return !sys->searchmatcher.IsEmpty() && sys->searchmatcher.Matches(t.Get());
     }
 
     template<typename DC>
@@ -178,32 +337,32 @@ struct Text {
                int maxcolwidth) const {
         auto ixs = 0;
         auto iys = 0;
-        if (!cell->tiny) { treesheets::System::ImageSize(DisplayImage(), ixs, iys); }
+        if (!cell->L().tiny) { treesheets::System::ImageSize(DisplayImage(), ixs, iys); }
 
         if (ixs != 0 && iys != 0) {
             treesheets::System::ImageDraw(DisplayImage(), dc, bx + 1 + g_margin_extra,
-                                          by + (cell->tys - iys) / 2 + g_margin_extra);
+                                          by + (cell->L().tys - iys) / 2 + g_margin_extra);
             ixs += 2;
             iys += 2;
         }
 
-        if (t.empty()) { return iys; }
+        if (t.IsEmpty()) { return iys; }
 
         doc->PickFont(dc, depth, relsize, stylebits);
 
-        auto h = cell->tiny ? 1 : dc.GetCharHeight();
+        auto h = cell->L().tiny ? 1 : dc.GetCharHeight();
         leftoffset = h;
         auto i = 0;
         auto lines = 0;
         auto searchfound = IsInSearch();
-        auto istag = cell->IsTag(doc);
-        if (cell->tiny) {
+        auto tagcolor = cell->TagColor(doc);
+        if (cell->L().tiny) {
             if (searchfound) {
                 dc.SetPen(*wxRED_PEN);
             } else if (filtered) {
                 dc.SetPen(*wxLIGHT_GREY_PEN);
-            } else if (istag) {
-                dc.SetPen(wxPen(LightColor(doc->tags[t])));
+            } else if (tagcolor != nullptr) {
+                dc.SetPen(wxPen(LightColor(*tagcolor)));
             } else {
                 dc.SetPen(sys->pen_tinytext);
             }
@@ -211,7 +370,7 @@ struct Text {
         for (;;) {
             auto curl = GetLine(i, maxcolwidth);
             if (curl.IsEmpty()) { break; }
-            if (cell->tiny) {
+            if (cell->L().tiny) {
                 if (sys->fastrender) {
                     dc.DrawLine(bx + ixs, by + lines * h, bx + ixs + static_cast<int>(curl.Len()),
                                 by + lines * h);
@@ -238,15 +397,15 @@ struct Text {
                     dc.SetTextForeground(*wxRED);
                 } else if (filtered) {
                     dc.SetTextForeground(*wxLIGHT_GREY);
-                } else if (istag) {
-                    dc.SetTextForeground(LightColor(doc->tags[t]));
+                } else if (tagcolor != nullptr) {
+                    dc.SetTextForeground(LightColor(*tagcolor));
                 } else if (cell->textcolor != 0U) {
                     dc.SetTextForeground(LightColor(cell->textcolor));  // FIXME: clean up
                 }
                 auto tx = bx + 2 + ixs;
                 auto ty = by + lines * h;
                 dc.DrawText(curl, tx + g_margin_extra, ty + g_margin_extra);
-                if (searchfound || filtered || istag || cell->textcolor != 0U) {
+                if (searchfound || filtered || tagcolor != nullptr || cell->textcolor != 0U) {
                     dc.SetTextForeground(LightColor(0x000000));
                 }
             }
@@ -262,7 +421,7 @@ struct Text {
 
         auto ixs = 0;
         auto iys = 0;
-        if (!cell->tiny) { treesheets::System::ImageSize(DisplayImage(), ixs, iys); }
+        if (!cell->L().tiny) { treesheets::System::ImageSize(DisplayImage(), ixs, iys); }
         if (ixs != 0) { ixs += 2; }
 
         doc->PickFont(dc, cell->Depth() - doc->drawpath.size(), relsize, stylebits);
@@ -294,7 +453,7 @@ struct Text {
                     int maxcolwidth) const {
         auto ixs = 0;
         auto iys = 0;
-        if (!cell->tiny) { treesheets::System::ImageSize(DisplayImage(), ixs, iys); }
+        if (!cell->L().tiny) { treesheets::System::ImageSize(DisplayImage(), ixs, iys); }
         if (ixs != 0) { ixs += 2; }
         doc->PickFont(dc, cell->Depth() - doc->drawpath.size(), relsize, stylebits);
         auto h = dc.GetCharHeight();
@@ -316,8 +475,8 @@ struct Text {
                         dc.GetTextExtent(ls, &x1, nullptr);
                         if (x1 != x2) {
                             int startx = cell->GetX(doc) + x1 + 2 + ixs + g_margin_extra;
-                            int starty =
-                                cell->GetY(doc) + l * h + 1 + cell->ycenteroff + g_margin_extra;
+                            int starty = cell->GetY(doc) + l * h + 1 + cell->L().ycenteroff +
+                                         g_margin_extra;
                             DrawRectangle(dc, color, startx, starty, x2 - x1, h - 1, true);
                             HintIMELocation(doc, startx, starty, h - 1, stylebits);
                         }
@@ -327,7 +486,8 @@ struct Text {
                     auto x = 0;
                     dc.GetTextExtent(ls, &x, nullptr);
                     int startx = cell->GetX(doc) + x + 1 + ixs + g_margin_extra;
-                    int starty = cell->GetY(doc) + l * h + 1 + cell->ycenteroff + g_margin_extra;
+                    int starty =
+                        cell->GetY(doc) + l * h + 1 + cell->L().ycenteroff + g_margin_extra;
                     DrawRectangle(dc, color, startx, starty, 2, h - 2);
                     HintIMELocation(doc, startx, starty, h - 2, stylebits);
                     break;
@@ -387,7 +547,7 @@ struct Text {
         if (!s.TextEdit()) { Clear(doc, s); }
         RangeSelRemove(s);
         if (prevl == 0U && !keeprelsize) { SetRelSize(s); }
-        t.insert(s.cursor, ins);
+        t.Insert(s.cursor, ins);
         s.cursor = s.cursorend = s.cursor + static_cast<int>(ins.Len());
     }
 
@@ -419,26 +579,11 @@ struct Text {
         Backspace(s);
     }
 
-    void ReplaceStr(const wxString &str, const wxString &lstr) {
-        if (sys->casesensitivesearch) {
-            for (auto i = 0, j = 0; (j = t.Mid(i).Find(sys->searchstring)) >= 0;) {
-                WasEdited();
-                i += j;
-                t.Remove(i, sys->searchstring.Len());
-                t.insert(i, str);
-                i += str.Len();
-            }
-        } else {
-            auto lowert = t.Lower();
-            for (auto i = 0, j = 0; (j = lowert.Mid(i).Find(sys->searchstring)) >= 0;) {
-                WasEdited();
-                i += j;
-                lowert.Remove(i, sys->searchstring.Len());
-                t.Remove(i, sys->searchstring.Len());
-                lowert.insert(i, lstr);
-                t.insert(i, str);
-                i += str.Len();
-            }
+    void ReplaceStr(const wxString &str) {
+        auto replaced = t.Get();
+        if (sys->searchmatcher.ReplaceAll(replaced, str)) {
+            t = replaced;
+            WasEdited();
         }
     }
 
@@ -464,7 +609,7 @@ struct Text {
     }
 
     void Save(wxDataOutputStream &dos) const {
-        dos.WriteString(t.wx_str());
+        WriteUTF8(dos, t);
         dos.Write32(relsize);
         dos.Write32(image != nullptr ? image->savedindex : -1);
         dos.Write32(stylebits);
@@ -472,39 +617,11 @@ struct Text {
         dos.Write64(&le, 1);
     }
 
-    void Load(wxDataInputStream &dis) {
-        t = dis.ReadString();
-
-        // if (t.length() > 10000)
-        //    printf("");
-
-        if (sys->versionlastloaded <= 11) {
-            dis.Read32();  // numlines
-        }
-
-        relsize = dis.Read32();
-
-        int i = dis.Read32();
-        image = i >= 0 && i < static_cast<int>(sys->loadimageids.size())
-                    ? sys->imagelist[sys->loadimageids[i]].get()
-                    : nullptr;
-
-        if (sys->versionlastloaded >= 7) { stylebits = dis.Read32(); }
-
-        wxLongLong time;
-        if (sys->versionlastloaded >= 14) {
-            dis.Read64(&time, 1);
-        } else {
-            time = sys->fakelasteditonload--;
-        }
-        lastedit = wxDateTime(time);
-    }
-
     auto Eval(Evaluator &ev) const {
         switch (cell->celltype) {
             // Load variable's data.
             case CT_VARU: {
-                auto v = ev.Lookup(t);
+                auto v = ev.Lookup(t.Get());
                 if (!v) {
                     v = cell->Clone(nullptr);
                     v->celltype = CT_DATA;
@@ -95,3 +95,931 @@ inline uint64_t FNV1A64(const uint8_t *data, size_t size) {
     }
     return hash;
 }
+
+// For unordered containers keyed on wxString.
+struct TextHash {
+    size_t operator()(const wxString &s) const {
+        return std::hash<std::wstring_view>()(std::wstring_view(s.wc_str(), s.length()));
+    }
+};
+
+// A string that is empty for nearly every owner, so it only costs a pointer until it is set.
+struct SparseString {
+    unique_ptr<wxString> s;
+
+    SparseString() = default;
+    SparseString(const SparseString &o) { *this = o.Get(); }
+    SparseString(SparseString &&) = default;
+    SparseString &operator=(const SparseString &o) { return *this = o.Get(); }
+    SparseString &operator=(SparseString &&) = default;
+
+    SparseString &operator=(const wxString &v) {
+        if (v.IsEmpty()) {
+            s.reset();
+        } else if (s) {
+            *s = v;
+        } else {
+            s = make_unique<wxString>(v);
+        }
+        return *this;
+    }
+
+    const wxString &Get() const {
+        static const wxString empty;
+        return s ? *s : empty;
+    }
+    operator const wxString &() const { return Get(); }
+    bool IsEmpty() const { return !s; }
+};
+
+// Cell text. While every character is Latin-1, as nearly all of it is in most documents, it is
+// kept a byte per character. Text short enough for the small string optimization of std::string
+// is stored inside the object. Longer text, and text with characters outside Latin-1, which is
+// kept as a wxString, goes in an immutable buffer that copies share until they are edited, so
+// cloning a subtree doesn't copy its text. Characters have the same index either way, so cursor
+// positions don't depend on the representation. Get() and Mid() convert to a wxString where wx
+// needs one, for drawing, searching and editing.
+struct CompactString {
+    // At most what fits in a std::string without a heap allocation in the common libraries.
+    static constexpr size_t INLINE = 15;
+
+    struct Shared {
+        std::string bytes;  // the Latin-1 characters, if wide is empty
+        wxString wide;
+
+        Shared(std::string &&_bytes) : bytes(std::move(_bytes)) {}
+        Shared(wxString &&_wide) : wide(std::move(_wide)) {}
+    };
+
+    std::string bytes;  // short Latin-1 text, while shared is null
+    shared_ptr<const Shared> shared;
+
+    CompactString() = default;
+    CompactString &operator=(const wxString &s) {
+        Set(s);
+        return *this;
+    }
+
+    static bool IsLatin1(const wxString &s) {
+        auto *p = s.wc_str();
+        loop(i, s.length()) {
+            if (static_cast<wxUint32>(p[i]) > 0xFF) { return false; }
+        }
+        return true;
+    }
+
+    static std::string Narrow(const wxString &s) {
+        auto *p = s.wc_str();
+        std::string r(s.length(), '\0');
+        loop(i, s.length()) r[i] = static_cast<char>(p[i]);
+        return r;
+    }
+
+    // Every edit ends up in one of these, which replace the text rather than change a buffer
+    // that other copies may share.
+    void SetBytes(std::string &&s) {
+        if (s.size() <= INLINE) {
+            bytes = std::move(s);
+            shared.reset();
+        } else {
+            bytes.clear();
+            shared = std::make_shared<const Shared>(std::move(s));
+        }
+    }
+    // Keeps the text narrow whenever it can be, which is what makes == a plain comparison.
+    void Set(const wxString &s) {
+        if (IsLatin1(s)) {
+            SetBytes(Narrow(s));
+        } else {
+            bytes.clear();
+            shared = std::make_shared<const Shared>(wxString(s));
+        }
+    }
+
+    const std::string &Bytes() const { return shared ? shared->bytes : bytes; }
+    const wxString *Wide() const {
+        return shared && !shared->wide.IsEmpty() ? &shared->wide : nullptr;
+    }
+
+    // What this text holds beyond sizeof(CompactString), counting a shared buffer in full.
+    size_t HeapBytes() const {
+        if (!shared) { return 0; }
+        auto *w = Wide();
+        return sizeof(Shared) + (w ? w->Len() * sizeof(wchar_t) : shared->bytes.size());
+    }
+
+    // Whether the bytes are also the UTF-8 of the text, so they can be saved as they are.
+    bool IsASCII() const {
+        if (Wide()) { return false; }
+        for (auto c : Bytes()) {
+            if ((c & 0x80) != 0) { return false; }
+        }
+        return true;
+    }
+
+    bool IsEmpty() const { return Len() == 0; }
+    size_t Len() const {
+        auto *w = Wide();
+        return w ? w->Len() : Bytes().size();
+    }
+    // Like wxString, the index one past the end gives 0.
+    wchar_t operator[](size_t i) const {
+        if (auto *w = Wide()) { return i < w->Len() ? w->wc_str()[i] : 0; }
+        auto &b = Bytes();
+        return i < b.size() ? static_cast<uchar>(b[i]) : 0;
+    }
+
+    wxString Get() const {
+        auto *w = Wide();
+        return w ? *w : Mid(0);
+    }
+    wxString Mid(size_t first, size_t count = wxString::npos) const {
+        if (auto *w = Wide()) { return w->Mid(first, count); }
+        auto &b = Bytes();
+        first = min(first, b.size());
+        count = min(count, b.size() - first);
+        return wxString(b.data() + first, wxConvISO8859_1, count);
+    }
+
+    void Clear() {
+        bytes.clear();
+        shared.reset();
+    }
+
+    void Insert(size_t pos, const wxString &s) { Replace(pos, 0, s); }
+    void Append(const wxString &s) { Replace(Len(), 0, s); }
+    void Append(wchar_t c, size_t count = 1) {
+        if (count == 0) { return; }
+        if (!Wide() && static_cast<wxUint32>(c) <= 0xFF) {
+            auto b = Bytes();
+            b.append(count, static_cast<char>(c));
+            SetBytes(std::move(b));
+        } else {
+            auto w = Get();
+            w.Append(c, count);
+            Set(w);
+        }
+    }
+    void Remove(size_t pos, size_t count) { Replace(pos, count, wxEmptyString); }
+    void Replace(size_t pos, size_t count, const wxString &s) {
+        if (!Wide() && IsLatin1(s)) {
+            auto b = Bytes();
+            b.replace(pos, count, Narrow(s));
+            SetBytes(std::move(b));
+        } else {
+            // Set() goes back to bytes if this removed the last character outside of Latin-1.
+            auto w = Get();
+            w.replace(pos, count, s);
+            Set(w);
+        }
+    }
+
+    bool operator==(const CompactString &o) const {
+        if (shared && shared == o.shared) { return true; }
+        auto *w = Wide();
+        auto *ow = o.Wide();
+        if (!w || !ow) { return !w && !ow && Bytes() == o.Bytes(); }
+        return *w == *ow;
+    }
+    bool operator!=(const CompactString &o) const { return !(*this == o); }
+    bool operator==(const wxString &s) const {
+        if (auto *w = Wide()) { return *w == s; }
+        auto &b = Bytes();
+        if (s.length() != b.size()) { return false; }
+        auto *p = s.wc_str();
+        loop(i, b.size()) {
+            if (static_cast<wxUint32>(p[i]) != static_cast<uchar>(b[i])) { return false; }
+        }
+        return true;
+    }
+    bool operator!=(const wxString &s) const { return !(*this == s); }
+};
+
+// What an export takes from the settings and the screen, captured on the UI thread so an
+// auto-export can run on a worker.
+struct ExportSettings {
+    wxString font;  // default font faces, for the HTML
+    wxString fixedfont;
+    double dipscale {1.0};  // for the size of exported images
+};
+
+// Collects exported text in document order. With a stream attached, Spill() passes it on once
+// enough has built up, so an export never holds more than a small buffer of the file at once.
+struct TextWriter {
+    wxString text;
+    wxTextOutputStream *stream;
+    ExportSettings settings;
+
+    TextWriter(wxTextOutputStream *_stream, const ExportSettings &_settings)
+        : stream(_stream), settings(_settings) {}
+
+    void Flush() {
+        if (!stream) { return; }
+        stream->WriteString(text);
+        text.clear();
+    }
+
+    void Spill() {
+        if (text.Len() >= 0x10000) { Flush(); }
+    }
+};
+
+// Calls f(begin, end) on consecutive ranges of at least minchunk items covering [0, n), each on
+// its own thread, and returns once all of them are done. Small n stays on the calling thread.
+template<typename F> void ParallelFor(size_t n, size_t minchunk, F f) {
+    size_t numthreads = std::clamp<size_t>(n / max<size_t>(minchunk, 1), 1,
+                                           max(1U, thread::hardware_concurrency()));
+    if (numthreads == 1) {
+        f(size_t(0), n);
+        return;
+    }
+    size_t chunk = (n + numthreads - 1) / numthreads;
+    vector<std::future<void>> workers;
+    for (size_t begin = chunk; begin < n; begin += chunk) {
+        workers.push_back(std::async(std::launch::async, f, begin, min(begin + chunk, n)));
+    }
+    f(size_t(0), chunk);
+    for (auto &worker : workers) { worker.wait(); }
+}
+
+// Reads delimiter separated text straight from the bytes of the file. A field that starts with
+// a quote runs to the closing quote ("" being a quote itself) and may span lines, the character
+// after the closing quote is skipped, and blank lines are dropped. The file is cut into chunks
+// of whole records in one pass, after which the chunks are parsed on all cores.
+struct CSVReader {
+    struct Chunk {
+        size_t begin;
+        size_t end;
+        size_t firstrow {0};
+        vector<int> numfields;  // per record
+        vector<wxString> fields;
+    };
+
+    char sep;
+    std::string data;
+    vector<Chunk> chunks;
+    size_t numrows {0};
+    int numcolumns {0};
+    bool latin1 {false};
+
+    CSVReader(char _sep) : sep(_sep) {}
+
+    bool Read(const wxString &filename) {
+        wxFile file(filename);
+        if (!file.IsOpened()) { return false; }
+        auto len = file.Length();
+        if (len < 0) { return false; }
+        data.resize(static_cast<size_t>(len));
+        if (file.Read(data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+            return false;
+        }
+        return DetectEncoding();
+    }
+
+    // Decides on the encoding once for the whole file, like wxConvAuto would: a byte order mark
+    // says which, UTF-16 and UTF-32 text is turned into UTF-8 up front, and text without one that
+    // isn't valid UTF-8 is taken to be Latin-1.
+    bool DetectEncoding() {
+        auto starts = [&](const char *bom, size_t len) {
+            return data.compare(0, len, bom, len) == 0;
+        };
+        unique_ptr<wxMBConv> conv;
+        size_t bom = 0;
+        if (starts("\xEF\xBB\xBF", 3)) {
+            data.erase(0, 3);
+            return true;
+        } else if (starts("\xFF\xFE\0\0", 4)) {
+            conv = make_unique<wxMBConvUTF32LE>();
+            bom = 4;
+        } else if (starts("\0\0\xFE\xFF", 4)) {
+            conv = make_unique<wxMBConvUTF32BE>();
+            bom = 4;
+        } else if (starts("\xFF\xFE", 2)) {
+            conv = make_unique<wxMBConvUTF16LE>();
+            bom = 2;
+        } else if (starts("\xFE\xFF", 2)) {
+            conv = make_unique<wxMBConvUTF16BE>();
+            bom = 2;
+        }
+        if (conv) {
+            wxString text(data.data() + bom, *conv, data.size() - bom);
+            if (text.IsEmpty() && data.size() > bom) { return false; }
+            auto utf8 = text.utf8_str();
+            data.assign(utf8.data(), utf8.length());
+            return true;
+        }
+        latin1 = wxConvUTF8.ToWChar(nullptr, 0, data.data(), data.size()) == wxCONV_FAILED;
+        return true;
+    }
+
+    void Parse() {
+        const size_t chunksize = 1 << 20;
+        const char *start = data.data();
+        const char *e = start + data.size();
+        const char *p = start;
+        for (;;) {
+            p = SkipBreaks(p, e);
+            if (p == e) { break; }
+            auto *begin = p;
+            while (p < e && static_cast<size_t>(p - begin) < chunksize) {
+                p = SkipBreaks(RecordEnd(p, e), e);
+            }
+            chunks.push_back({static_cast<size_t>(begin - start), static_cast<size_t>(p - start)});
+        }
+        ParallelFor(chunks.size(), 1, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; i++) { ParseChunk(chunks[i]); }
+        });
+        for (auto &chunk : chunks) {
+            chunk.firstrow = numrows;
+            numrows += chunk.numfields.size();
+            for (auto n : chunk.numfields) { numcolumns = max(numcolumns, n); }
+        }
+    }
+
+    static bool IsBreak(char c) { return c == '\r' || c == '\n'; }
+
+    static const char *SkipBreaks(const char *p, const char *e) {
+        while (p < e && IsBreak(*p)) { p++; }
+        return p;
+    }
+
+    // The first line break outside of quotes.
+    const char *RecordEnd(const char *p, const char *e) const {
+        auto fieldstart = true;
+        while (p < e && !IsBreak(*p)) {
+            if (fieldstart && *p == '"') {
+                p = QuoteEnd(p + 1, e);
+                if (p < e) { p++; }
+                if (p < e && !IsBreak(*p)) { p++; }
+                continue;
+            }
+            fieldstart = *p++ == sep;
+        }
+        return p;
+    }
+
+    // The closing quote of a quoted field whose text starts at p, or e.
+    static const char *QuoteEnd(const char *p, const char *e) {
+        for (;;) {
+            p = static_cast<const char *>(memchr(p, '"', e - p));
+            if (p == nullptr) { return e; }
+            if (p + 1 < e && p[1] == '"') {
+                p += 2;
+            } else {
+                return p;
+            }
+        }
+    }
+
+    void ParseChunk(Chunk &chunk) const {
+        const char *p = data.data() + chunk.begin;
+        const char *e = data.data() + chunk.end;
+        std::string word;
+        for (p = SkipBreaks(p, e); p < e; p = SkipBreaks(p, e)) {
+            auto *end = RecordEnd(p, e);
+            int n = 0;
+            for (; p < end; n++) {
+                if (*p != '"') {
+                    auto *q = static_cast<const char *>(memchr(p, sep, end - p));
+                    if (q == nullptr) { q = end; }
+                    chunk.fields.push_back(Decode(p, q - p));
+                    p = q < end ? q + 1 : end;
+                    continue;
+                }
+                auto *q = QuoteEnd(++p, end);
+                word.clear();
+                while (p < q) {
+                    if (*p == '"') {
+                        word += '"';
+                        p += 2;
+                    } else if (IsBreak(*p)) {
+                        // Each line break keeps one separator, but the end of the file doesn't.
+                        p = SkipBreaks(p, q);
+                        if (p < q || q < end) { word += LINE_SEPARATOR; }
+                    } else {
+                        word += *p++;
+                    }
+                }
+                chunk.fields.push_back(Decode(word.data(), word.size()));
+                p = end - q > 2 ? q + 2 : end;
+            }
+            chunk.numfields.push_back(n);
+        }
+    }
+
+    // Fields are cut at ASCII characters only, so they are valid UTF-8 if the file is.
+    wxString Decode(const char *p, size_t len) const {
+        return latin1 ? wxString(p, wxConvISO8859_1, len) : wxString::FromUTF8Unchecked(p, len);
+    }
+};
+
+// Reads XML from a stream as a sequence of start tags, end tags and text, holding on to nothing
+// but the current one. Covers what our own exports and most other XML contain: attributes, the
+// predefined and numeric entities, and CDATA. Comments, processing instructions and the DOCTYPE
+// are skipped. Text is converted from the encoding given in the XML declaration, so encodings
+// that aren't a superset of ASCII (UTF-16, UTF-32) aren't supported, see IsSupported().
+struct XMLReader {
+    enum { XML_START, XML_END, XML_TEXT, XML_EOF, XML_ERROR };
+
+    wxInputStream &in;
+    std::string buf;
+    size_t pos {0};
+    unique_ptr<wxCSConv> conv;  // nullptr for UTF-8
+    bool selfclosing {false};
+    wxString name;
+    wxString text;
+    vector<pair<wxString, wxString>> attributes;
+
+    XMLReader(wxInputStream &_in) : in(_in) {
+        Refill();
+        if (buf.compare(0, 3, "\xEF\xBB\xBF") == 0) { pos = 3; }
+    }
+
+    bool IsSupported() const {
+        return buf.size() < 2 || (buf[0] != 0 && buf[1] != 0 && static_cast<uchar>(buf[0]) < 0xFE);
+    }
+
+    bool Refill() {
+        buf.resize(0x10000);
+        in.Read(buf.data(), buf.size());
+        buf.resize(in.LastRead());
+        pos = 0;
+        return !buf.empty();
+    }
+
+    int Peek() {
+        if (pos == buf.size() && !Refill()) { return -1; }
+        return static_cast<uchar>(buf[pos]);
+    }
+
+    int Get() {
+        auto ch = Peek();
+        if (ch >= 0) { pos++; }
+        return ch;
+    }
+
+    static bool IsSpace(int ch) { return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'; }
+
+    void SkipSpace() {
+        while (IsSpace(Peek())) { pos++; }
+    }
+
+    // Appends raw to out, converted from the encoding of the document. Fails on text that isn't
+    // valid in that encoding, for which the conversion would give nothing.
+    bool Decode(const std::string &raw, wxString &out) const {
+        if (raw.empty()) { return true; }
+        auto s = conv ? wxString(raw.data(), *conv, raw.size())
+                      : wxString::FromUTF8(raw.data(), raw.size());
+        if (s.IsEmpty()) { return false; }
+        out += s;
+        return true;
+    }
+
+    wxString Attribute(const wxString &key, const wxString &def) const {
+        for (auto &[k, v] : attributes) {
+            if (k == key) { return v; }
+        }
+        return def;
+    }
+
+    int Next() {
+        if (selfclosing) {
+            selfclosing = false;
+            return XML_END;
+        }
+        for (;;) {
+            auto ch = Peek();
+            if (ch < 0) { return XML_EOF; }
+            if (ch != '<') { return ReadText('<', text) ? XML_TEXT : XML_ERROR; }
+            pos++;
+            ch = Get();
+            if (ch == '/') {
+                if (!ReadName(name)) { return XML_ERROR; }
+                SkipSpace();
+                return Get() == '>' ? XML_END : XML_ERROR;
+            }
+            if (ch == '?') {
+                std::string pi;
+                if (!ReadPast("?>", &pi)) { return XML_ERROR; }
+                if (pi.compare(0, 4, "xml ") == 0 && !SetEncoding(pi)) { return XML_ERROR; }
+                continue;
+            }
+            if (ch == '!') {
+                ch = Get();
+                if (ch == '-') {
+                    if (Get() != '-' || !ReadPast("-->", nullptr)) { return XML_ERROR; }
+                    continue;
+                }
+                if (ch == '[') {
+                    std::string cdata;
+                    if (!Expect("CDATA[") || !ReadPast("]]>", &cdata)) { return XML_ERROR; }
+                    text.clear();
+                    return Decode(cdata, text) ? XML_TEXT : XML_ERROR;
+                }
+                if (!SkipDeclaration()) { return XML_ERROR; }
+                continue;
+            }
+            if (ch < 0) { return XML_ERROR; }
+            pos--;
+            return ReadStartTag() ? XML_START : XML_ERROR;
+        }
+    }
+
+    bool ReadName(wxString &out) {
+        std::string raw;
+        for (auto ch = Peek(); ch >= 0 && !IsSpace(ch) && !strchr("/>=", ch); ch = Peek()) {
+            raw += static_cast<char>(ch);
+            pos++;
+        }
+        out.clear();
+        return Decode(raw, out) && !out.IsEmpty();
+    }
+
+    bool ReadStartTag() {
+        if (!ReadName(name)) { return false; }
+        attributes.clear();
+        for (;;) {
+            SkipSpace();
+            auto ch = Peek();
+            if (ch == '>' || ch == '/') {
+                pos++;
+                selfclosing = ch == '/';
+                return !selfclosing || Get() == '>';
+            }
+            wxString key;
+            if (!ReadName(key)) { return false; }
+            SkipSpace();
+            if (Get() != '=') { return false; }
+            SkipSpace();
+            auto quote = Get();
+            if (quote != '"' && quote != '\'') { return false; }
+            wxString value;
+            if (!ReadText(quote, value)) { return false; }
+            pos++;
+            attributes.emplace_back(key, value);
+        }
+    }
+
+    // Text up to (but not including) end or the end of the file, with entities resolved.
+    bool ReadText(int end, wxString &out) {
+        out.clear();
+        std::string raw;
+        for (auto ch = Peek(); ch >= 0 && ch != end; ch = Peek()) {
+            pos++;
+            if (ch != '&') {
+                // Attribute values see their line breaks and tabs as spaces.
+                raw += end != '<' && IsSpace(ch) ? ' ' : static_cast<char>(ch);
+                continue;
+            }
+            std::string entity;
+            for (ch = Get(); ch >= 0 && ch != ';' && entity.size() < 10; ch = Get()) {
+                entity += static_cast<char>(ch);
+            }
+            if (ch != ';' || !Decode(raw, out)) { return false; }
+            raw.clear();
+            if (entity == "lt") {
+                out += '<';
+            } else if (entity == "gt") {
+                out += '>';
+            } else if (entity == "amp") {
+                out += '&';
+            } else if (entity == "quot") {
+                out += '"';
+            } else if (entity == "apos") {
+                out += '\'';
+            } else if (entity.size() > 1 && entity[0] == '#') {
+                auto hex = entity[1] == 'x';
+                auto code = strtoul(entity.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10);
+                if (code == 0 || code > 0x10FFFF) { return false; }
+                out += wxUniChar(static_cast<wxUint32>(code));
+            } else {
+                return false;
+            }
+        }
+        if (end != '<' && Peek() != end) { return false; }
+        return Decode(raw, out);
+    }
+
+    bool Expect(const char *s) {
+        for (; *s; s++) {
+            if (Get() != *s) { return false; }
+        }
+        return true;
+    }
+
+    // Reads up to and including end, a run of one character followed by '>', optionally keeping
+    // what came before it.
+    bool ReadPast(const char *end, std::string *skipped) {
+        size_t len = strlen(end);
+        size_t matched = 0;
+        for (;;) {
+            auto ch = Get();
+            if (ch < 0) { return false; }
+            if (skipped) { *skipped += static_cast<char>(ch); }
+            if (ch == end[matched]) {
+                if (++matched == len) { break; }
+            } else {
+                matched = ch == end[0] ? max<size_t>(matched, 1) : 0;
+            }
+        }
+        if (skipped) { skipped->resize(skipped->size() - len); }
+        return true;
+    }
+
+    // <!DOCTYPE ...>, including an internal subset in [].
+    bool SkipDeclaration() {
+        int depth = 0;
+        int quote = 0;
+        for (;;) {
+            auto ch = Get();
+            if (ch < 0) { return false; }
+            if (quote != 0) {
+                if (ch == quote) { quote = 0; }
+            } else if (ch == '"' || ch == '\'') {
+                quote = ch;
+            } else if (ch == '[') {
+                depth++;
+            } else if (ch == ']') {
+                depth--;
+            } else if (ch == '>' && depth == 0) {
+                return true;
+            }
+        }
+    }
+
+    bool SetEncoding(const std::string &declaration) {
+        auto start = declaration.find("encoding");
+        if (start == std::string::npos) { return true; }
+        start = declaration.find_first_of("\"'", start);
+        if (start == std::string::npos) { return false; }
+        auto end = declaration.find(declaration[start], start + 1);
+        if (end == std::string::npos) { return false; }
+        auto encoding = wxString(declaration.substr(start + 1, end - start - 1)).Upper();
+        if (encoding == "UTF-8" || encoding == "US-ASCII") { return true; }
+        conv = make_unique<wxCSConv>(encoding);
+        return conv->IsOk();
+    }
+};
+
+// Hands out blocks of SIZE bytes carved from larger chunks, and keeps freed blocks on the free
+// list of their chunk for reuse. A chunk goes back to the heap once all of its blocks are free
+// again, except for one kept around for the next allocation, so closing a document returns its
+// memory. Each thread has its own pool. A block freed on another thread is handed back to the
+// pool it came from, which takes it in on its next allocation.
+template<size_t SIZE> struct BlockPool {
+    struct Chunk;
+    struct Block {
+        Chunk *chunk;
+        union {
+            Block *next;
+            alignas(std::max_align_t) char data[SIZE];
+        } u;
+    };
+    struct Chunk {
+        BlockPool *pool;
+        Chunk *prev {nullptr};  // in the pool's list of chunks with free blocks
+        Chunk *next {nullptr};
+        Block *freelist {nullptr};
+        size_t used {0};
+        size_t size {0};
+        unique_ptr<Block[]> blocks;
+    };
+    Chunk *available {nullptr};
+    unique_ptr<Chunk> spare;
+    size_t chunksize {64};
+    size_t numfree {0};  // in the available chunks
+    std::atomic<Block *> remote {nullptr};  // freed on other threads
+
+    void Link(Chunk *c) {
+        c->prev = nullptr;
+        c->next = available;
+        if (available) { available->prev = c; }
+        available = c;
+    }
+
+    void Unlink(Chunk *c) {
+        if (c->prev) {
+            c->prev->next = c->next;
+        } else {
+            available = c->next;
+        }
+        if (c->next) { c->next->prev = c->prev; }
+        c->prev = c->next = nullptr;
+    }
+
+    void AddChunk() {
+        auto c = std::move(spare);
+        if (!c) {
+            c = make_unique<Chunk>();
+            c->pool = this;
+            c->size = chunksize;
+            c->blocks = make_unique<Block[]>(chunksize);
+            loop(i, chunksize) {
+                c->blocks[i].chunk = c.get();
+                c->blocks[i].u.next = i + 1 < chunksize ? &c->blocks[i + 1] : nullptr;
+            }
+            c->freelist = c->blocks.get();
+            chunksize = min<size_t>(chunksize * 2, 4096);
+        }
+        numfree += c->size;
+        Link(c.release());
+    }
+
+    // Adds chunks up front until the next n allocations are sure to find a free block, for a
+    // bulk copy whose size is known.
+    void Reserve(size_t n) {
+        if (remote.load(std::memory_order_relaxed) != nullptr) { TakeRemote(); }
+        while (numfree < n) { AddChunk(); }
+    }
+
+    void *Alloc() {
+        if (remote.load(std::memory_order_relaxed) != nullptr) { TakeRemote(); }
+        if (!available) { AddChunk(); }
+        auto *c = available;
+        auto *b = c->freelist;
+        c->freelist = b->u.next;
+        c->used++;
+        numfree--;
+        if (!c->freelist) { Unlink(c); }
+        return b->u.data;
+    }
+
+    void Release(Block *b) {
+        auto *c = b->chunk;
+        if (!c->freelist) { Link(c); }
+        b->u.next = c->freelist;
+        c->freelist = b;
+        numfree++;
+        if (--c->used > 0) { return; }
+        Unlink(c);
+        numfree -= c->size;
+        unique_ptr<Chunk> empty(c);
+        if (!spare) { spare = std::move(empty); }
+    }
+
+    void TakeRemote() {
+        for (auto *b = remote.exchange(nullptr, std::memory_order_acquire); b != nullptr;) {
+            auto *next = b->u.next;
+            Release(b);
+            b = next;
+        }
+    }
+
+    void Free(void *p) {
+        auto *b = reinterpret_cast<Block *>(static_cast<char *>(p) - offsetof(Block, u));
+        auto *pool = b->chunk->pool;
+        if (pool == &Get()) {
+            Release(b);
+            return;
+        }
+        b->u.next = pool->remote.load(std::memory_order_relaxed);
+        while (!pool->remote.compare_exchange_weak(b->u.next, b, std::memory_order_release,
+                                                   std::memory_order_relaxed)) {}
+    }
+
+    // Never destroyed, so objects that outlive static destruction can still be freed.
+    static BlockPool &Get() {
+        static thread_local auto *pool = new BlockPool();
+        return *pool;
+    }
+};
+
+// Standard allocator on top of BlockPool, for use with allocate_shared.
+template<typename T> struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template<typename U> PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        if (n != 1) { return static_cast<T *>(::operator new(n * sizeof(T))); }
+        return static_cast<T *>(BlockPool<sizeof(T)>::Get().Alloc());
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p);
+        } else {
+            BlockPool<sizeof(T)>::Get().Free(p);
+        }
+    }
+
+    template<typename U> bool operator==(const PoolAllocator<U> &) const { return true; }
+};
+
+template<typename T, typename... Args> shared_ptr<T> make_pooled(Args &&...args) {
+    return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+}
+
+// Lowercases a single character the same way wxString::Lower() does, without calling into the
+// C library for ASCII.
+inline wchar_t FoldCase(wchar_t c) {
+    if (static_cast<uint>(c) < 128) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+    return static_cast<wchar_t>(towlower(c));
+}
+
+#ifdef TS_SSE2
+inline __m128i WideSet1(wchar_t c) {
+    if constexpr (sizeof(wchar_t) == 2) {
+        return _mm_set1_epi16(static_cast<short>(c));
+    } else {
+        return _mm_set1_epi32(static_cast<int>(c));
+    }
+}
+
+inline __m128i WideCmpEq(__m128i a, __m128i b) {
+    if constexpr (sizeof(wchar_t) == 2) {
+        return _mm_cmpeq_epi16(a, b);
+    } else {
+        return _mm_cmpeq_epi32(a, b);
+    }
+}
+
+inline __m128i WideCmpGt(__m128i a, __m128i b) {
+    if constexpr (sizeof(wchar_t) == 2) {
+        return _mm_cmpgt_epi16(a, b);
+    } else {
+        return _mm_cmpgt_epi32(a, b);
+    }
+}
+
+inline __m128i WideLoad(const wchar_t *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+// FoldCase for the ASCII lanes of v, the others are left as they are.
+inline __m128i WideFoldAscii(__m128i v) {
+    // SSE2 only compares signed lanes, flipping the sign bit makes that an unsigned compare.
+    const auto sign = sizeof(wchar_t) == 2 ? 0x8000U : 0x80000000U;
+    auto biased = _mm_xor_si128(v, WideSet1(static_cast<wchar_t>(sign)));
+    auto upper = _mm_and_si128(WideCmpGt(biased, WideSet1(static_cast<wchar_t>(('A' - 1) ^ sign))),
+                               WideCmpGt(WideSet1(static_cast<wchar_t>(('Z' + 1) ^ sign)), biased));
+    return _mm_or_si128(v, _mm_and_si128(upper, WideSet1('a' - 'A')));
+}
+
+// All ones in the lanes of v that aren't ASCII, which only towlower can fold.
+inline __m128i WideNonAscii(__m128i v) {
+    auto ascii = WideCmpEq(_mm_and_si128(v, WideSet1(static_cast<wchar_t>(~0x7F))),
+                           _mm_setzero_si128());
+    return _mm_andnot_si128(ascii, WideCmpEq(v, v));
+}
+#endif
+
+// Same result as wxString(haystack).Lower().Find(needle) for an already lowercased needle, but
+// folds the haystack on the fly instead of allocating a lowered copy of it. With SSE2 both the
+// scan for the first character and the comparison of the rest fold a register at a time, only
+// non-ASCII characters go through towlower.
+inline int FindFolded(const wchar_t *haystack, size_t haylen, const wchar_t *needle,
+                      size_t needlelen) {
+    if (needlelen == 0) { return 0; }
+    if (needlelen > haylen) { return -1; }
+    #ifdef TS_SSE2
+        const size_t lanes = sizeof(__m128i) / sizeof(wchar_t);
+    #endif
+    auto matchesat = [&](size_t i) {
+        size_t j = 0;
+        #ifdef TS_SSE2
+            for (; j + lanes <= needlelen; j += lanes) {
+                auto h = WideFoldAscii(WideLoad(haystack + i + j));
+                auto same = _mm_movemask_epi8(WideCmpEq(h, WideLoad(needle + j)));
+                if (same == 0xFFFF) { continue; }
+                for (size_t k = 0; k < lanes; k++) {
+                    if (!(same & (1 << (k * sizeof(wchar_t)))) &&
+                        FoldCase(haystack[i + j + k]) != needle[j + k]) {
+                        return false;
+                    }
+                }
+            }
+        #endif
+        for (; j < needlelen; j++) {
+            if (FoldCase(haystack[i + j]) != needle[j]) { return false; }
+        }
+        return true;
+    };
+    size_t last = haylen - needlelen;
+    size_t i = 0;
+    #ifdef TS_SSE2
+        // A non-ASCII character may fold to anything (e.g. KELVIN SIGN to 'k'), so those are
+        // flagged along with the folded matches of the first character and verified one by one.
+        // For a letter, setting the case bit is all the folding the scan needs.
+        auto isletter = needle[0] >= 'a' && needle[0] <= 'z';
+        auto vfirst = WideSet1(needle[0]);
+        auto vcase = WideSet1('a' - 'A');
+        for (; i + lanes - 1 <= last; i += lanes) {
+            auto v = WideLoad(haystack + i);
+            auto folded = isletter ? _mm_or_si128(v, vcase) : WideFoldAscii(v);
+            auto candidates = _mm_or_si128(WideCmpEq(folded, vfirst), WideNonAscii(v));
+            if (uint mask = _mm_movemask_epi8(candidates); mask != 0) {
+                for (size_t k = 0; k < lanes; k++) {
+                    if (mask & (1u << (k * sizeof(wchar_t))) && matchesat(i + k)) {
+                        return static_cast<int>(i + k);
+                    }
+                }
+            }
+        }
+    #endif
+    for (; i <= last; i++) {
+        if (matchesat(i)) { return static_cast<int>(i); }
+    }
+    return -1;
+}
@@ -97,7 +97,7 @@ struct TreeSheetsScriptImpl : public ScriptInterface {
 
     void GoToChild(int n) override {
         if (current->grid && n >= 0 && n < current->grid->xs * current->grid->ys) {
-            current = current->grid->cells[n].get();
+            current = current->grid->C(n % current->grid->xs, n / current->grid->xs).get();
         }
     }
 
@@ -108,9 +108,9 @@ struct TreeSheetsScriptImpl : public ScriptInterface {
         }
     }
 
-    std::string GetText() override { return current->text.t.utf8_string(); }
+    std::string GetText() override { return current->text.t.Get().utf8_string(); }
 
-    std::string GetNote() override { return current->note.utf8_string(); }
+    std::string GetNote() override { return current->note.Get().utf8_string(); }
 
     void SetText(std::string_view t) override {
         if (current->parent != nullptr) {
@@ -68,13 +68,13 @@ struct TSCanvas : public wxScrolledCanvas {
                     }
                 }
             }
-            sys->frame->UpdateStatus(doc->selected, true);
+            sys->frame->UpdateStatus(doc.get(), doc->selected, true);
         } else if (me.MiddleIsDown()) {
             wxPoint p = me.GetPosition() - lastmousepos;
             CursorScroll(-p.x, -p.y);
         } else {
             if (doc->hover != doc->prev && !doc->hover.Thin()) {
-                sys->frame->UpdateStatus(doc->hover, false);
+                sys->frame->UpdateStatus(doc.get(), doc->hover, false);
             }
         }
         lastmousepos = me.GetPosition();
@@ -88,7 +88,7 @@ struct TSCanvas : public wxScrolledCanvas {
         doc->isctrlshiftdrag = isctrlshift;
         doc->UpdateHover(dc, mx, my);
         doc->SelectClick(right);
-        sys->frame->UpdateStatus(doc->selected, true);
+        sys->frame->UpdateStatus(doc.get(), doc->selected, true);
         Refresh();
     }
 
@@ -112,7 +112,7 @@ struct TSCanvas : public wxScrolledCanvas {
             wxInfoDC dc(this);
             doc->UpdateHover(dc, me.GetX(), me.GetY());
             doc->SelectUp();
-            sys->frame->UpdateStatus(doc->selected, true);
+            sys->frame->UpdateStatus(doc.get(), doc->selected, true);
             Refresh();
         }
     }
@@ -130,7 +130,7 @@ struct TSCanvas : public wxScrolledCanvas {
         wxInfoDC dc(this);
         doc->UpdateHover(dc, me.GetX(), me.GetY());
         doc->DoubleClick();
-        sys->frame->UpdateStatus(doc->selected, true);
+        sys->frame->UpdateStatus(doc.get(), doc->selected, true);
         Refresh();
     }
 
@@ -18,6 +18,7 @@ struct TSFrame : wxFrame {
     wxColour toolbarbackgroundcolor {0xD8C7BC};
     wxTextCtrl *filter {nullptr};
     wxTextCtrl *replaces {nullptr};
+    SearchResultsPanel *searchresults {nullptr};
     ColorDropdown *cellcolordropdown {nullptr};
     ColorDropdown *textcolordropdown {nullptr};
     ColorDropdown *bordercolordropdown {nullptr};
@@ -476,9 +477,19 @@ struct TSFrame : wxFrame {
         semenu->AppendCheckItem(A_SEARCHFOLDED, _("Search in folded grids"));
         semenu->Check(A_SEARCHFOLDED, sys->searchfolded);
         semenu->AppendSeparator();
+        semenu->AppendRadioItem(A_SEARCHPLAIN, _("Plain text search"));
+        semenu->AppendRadioItem(A_SEARCHWHOLEWORD, _("Whole word search"));
+        semenu->AppendRadioItem(A_SEARCHREGEX, _("Regular expression search"));
+        semenu->AppendRadioItem(A_SEARCHFUZZY, _("Fuzzy search"));
+        semenu->Check(sys->searchmode + A_SEARCHPLAIN, true);
+        semenu->AppendSeparator();
         MyAppend(semenu, A_SEARCHNEXT, _("&Next Match") + "\tF3", _("Go to next search match"));
         MyAppend(semenu, A_SEARCHPREV, _("&Previous Match") + "\tSHIFT+F3",
                  _("Go to previous search match"));
+        MyAppend(semenu, A_SEARCHRESULTS, _("Show All &Matches"),
+                 _("Toggle a panel listing every cell that matches the search"));
+        MyAppend(semenu, A_FINDINFILES, _("Find in &Files..."),
+                 _("Search all TreeSheets files in a folder for the current search"));
         semenu->AppendSeparator();
         MyAppend(semenu, wxID_REPLACE, _("&Replace") + "\tCTRL+H",
                  _("Find and replace in document"));
@@ -592,6 +603,8 @@ struct TSFrame : wxFrame {
         MyAppend(optmenu, A_SETLANG, _("Change language..."), _("Change interface language"));
         MyAppend(optmenu, A_DEFAULTMAXCOLWIDTH, _("Default column width..."),
                  _("Set the default column width for a new grid"));
+        MyAppend(optmenu, A_UNDOLIMITS, _("Undo history limits..."),
+                 _("Set how much undo history is kept in memory before older steps move to disk"));
         optmenu->AppendSeparator();
         MyAppend(optmenu, A_CUSTCOL, _("Custom &color..."),
                  _("Set a custom color for the color dropdowns"));
@@ -642,6 +655,10 @@ struct TSFrame : wxFrame {
         optmenu->AppendCheckItem(A_AUTOSAVE, _("Autosave"),
                                  _("Save open documents periodically to temporary files"));
         optmenu->Check(A_AUTOSAVE, sys->autosave);
+        optmenu->AppendCheckItem(A_UNDOJOURNAL, _("Keep undo history"),
+                                 _("Save the undo history next to each document, so undo still "
+                                   "works after it is closed and opened again"));
+        optmenu->Check(A_UNDOJOURNAL, sys->undojournal);
         optmenu->AppendCheckItem(
             A_FSWATCH, _("Autoreload documents"),
             _("Reload when another computer has changed a file (if you have made changes, asks)"));
@@ -737,7 +754,7 @@ struct TSFrame : wxFrame {
 
         RefreshToolBar();
 
-        auto *sb = CreateStatusBar(5);
+        auto *sb = CreateStatusBar(6);
         SetStatusBarPane(0);
         SetDPIAwareStatusWidths();
         sb->Show(sys->showstatusbar);
@@ -786,6 +803,13 @@ struct TSFrame : wxFrame {
         aui.AddPane(
             notebook,
             wxAuiPaneInfo().Name("notebook").Caption("Notebook").CenterPane().PaneBorder(false));
+        searchresults = new SearchResultsPanel(this);
+        aui.AddPane(searchresults, wxAuiPaneInfo()
+                                       .Name("searchresults")
+                                       .Caption(_("Search Results"))
+                                       .Right()
+                                       .BestSize(FromDIP(wxSize(360, 400)))
+                                       .Hide());
         aui.LoadPerspective(sys->cfg->Read("perspective", ""));
         aui.Update();
 
@@ -1195,9 +1219,27 @@ struct TSFrame : wxFrame {
                 break;
             }
 
+            case A_UNDOLIMITS: {
+                int mb = wxGetNumberFromUser(
+                    _("Please enter how many megabytes of undo history to keep in memory:"),
+                    _("Megabytes"), _("Undo history limits"), sys->undomemory, 1, 100000,
+                    sys->frame);
+                if (mb <= 0) { break; }
+                int steps = wxGetNumberFromUser(
+                    _("Please enter how many undo steps to keep in memory:"), _("Steps"),
+                    _("Undo history limits"), sys->undosteps, 1, 1000000, sys->frame);
+                if (steps <= 0) { break; }
+                sys->cfg->Write("undomemory", sys->undomemory = mb);
+                sys->cfg->Write("undosteps", sys->undosteps = steps);
+                break;
+            }
+
             case A_LEFTTABS: Check("lefttabs"); break;
             case A_SINGLETRAY: Check("singletray"); break;
             case A_MAKEBAKS: sys->cfg->Write("makebaks", sys->makebaks = ce.IsChecked()); break;
+            case A_UNDOJOURNAL:
+                sys->cfg->Write("undojournal", sys->undojournal = ce.IsChecked());
+                break;
             case A_TOTRAY: sys->cfg->Write("totray", sys->totray = ce.IsChecked()); break;
             case A_MINCLOSE: sys->cfg->Write("minclose", sys->minclose = ce.IsChecked()); break;
             case A_STARTMINIMIZED:
@@ -1261,7 +1303,15 @@ struct TSFrame : wxFrame {
                 break;
             case A_SEARCHFOLDED:
                 sys->cfg->Write("searchfolded", sys->searchfolded = ce.IsChecked());
+                searchresults->Start(canvas->doc.get());
                 break;
+            case A_SEARCHRESULTS: {
+                auto &pane = aui.GetPane(searchresults);
+                pane.Show(!pane.IsShown());
+                aui.Update();
+                searchresults->Start(canvas->doc.get());
+                break;
+            }
             case wxID_REPLACE:
                 if (replaces != nullptr) {
                     replaces->SetFocus();
@@ -1310,7 +1360,8 @@ struct TSFrame : wxFrame {
         auto *canvas = dynamic_cast<TSCanvas *>(notebook->GetPage(nbe.GetSelection()));
         canvas->SetFocus();
         canvas->doc->UpdateFileName();
-        UpdateStatus(canvas->doc->selected, true);
+        UpdateStatus(canvas->doc.get(), canvas->doc->selected, true);
+        searchresults->Start(canvas->doc.get());
         nbe.Skip();
     }
 
@@ -1322,6 +1373,7 @@ struct TSFrame : wxFrame {
         } else if (canvas->doc->CloseDocument()) {
             nbe.Veto();
         } else {
+            searchresults->Forget(canvas->doc.get());
             nbe.Skip();
         }
     }
@@ -1332,15 +1384,14 @@ struct TSFrame : wxFrame {
     }
 
     void OnSearch(wxCommandEvent &ce) {
-        auto searchstring = ce.GetString();
-        sys->darkennonmatchingcells = searchstring.Len() != 0;
-        sys->searchstring = sys->casesensitivesearch ? searchstring : searchstring.Lower();
+        SetStatus(sys->SetSearch(ce.GetString()));
         TSCanvas *canvas = GetCurrentTab();
         Document *doc = canvas->doc.get();
         if (doc->searchfilter) {
-            doc->SetSearchFilter(sys->searchstring.Len() != 0);
+            doc->SetSearchFilter(!sys->searchmatcher.IsEmpty());
             doc->searchfilter = true;
         }
+        searchresults->Start(doc);
         canvas->Refresh();
     }
 
@@ -1618,8 +1669,9 @@ struct TSFrame : wxFrame {
     }
 
     void SetDPIAwareStatusWidths() {
-        int statusbarfieldwidths[] = {-1, FromDIP(300), FromDIP(120), FromDIP(100), FromDIP(150)};
-        SetStatusWidths(5, statusbarfieldwidths);
+        int statusbarfieldwidths[] = {-1,           FromDIP(300), FromDIP(120),
+                                      FromDIP(100), FromDIP(150), FromDIP(200)};
+        SetStatusWidths(6, statusbarfieldwidths);
     }
 
     void SetFileAssoc(const wxString &exename) {
@@ -1669,7 +1721,7 @@ struct TSFrame : wxFrame {
         }
     }
 
-    void UpdateStatus(const Selection &s, bool updateamount) {
+    void UpdateStatus(Document *doc, const Selection &s, bool updateamount) {
         if (GetStatusBar() != nullptr && s.grid != nullptr) {
             if (Cell *c = s.GetCell(); c != nullptr && s.xs != 0) {
                 SetStatusText(wxString::Format(_("Size %d"), -c->text.relsize), 3);
@@ -1680,7 +1732,14 @@ struct TSFrame : wxFrame {
             } else {
                 for (int field : {1, 2, 3}) { SetStatusText("", field); }
             }
-            if (updateamount) { SetStatusText(wxString::Format(_("%d cell(s)"), s.xs * s.ys), 4); }
+            if (updateamount) {
+                SetStatusText(wxString::Format(_("%d cell(s)"), s.xs * s.ys), 4);
+                auto &counts = doc->Counts();
+                SetStatusText(
+                    wxString::Format(_("Document %d cell(s), %s"), counts.cells,
+                                     wxFileName::GetHumanReadableSize(wxULongLong(counts.bytes))),
+                    5);
+            }
         }
     }
 
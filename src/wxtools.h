@@ -11,6 +11,50 @@ static void DrawRectangle(DC &dc, uint color, int x, int y, int xs, int ys, bool
 
 static uint SwapColor(uint c) { return ((c & 0xFF) << 16) | (c & 0xFF00) | ((c & 0xFF0000) >> 16); }
 
+// Same format as wxDataOutputStream::WriteString() and wxDataInputStream::ReadString(), but always
+// UTF-8, whatever conversion the stream was set up with.
+static void WriteUTF8(wxDataOutputStream &dos, const wxString &s) {
+    auto buf = s.utf8_str();
+    dos.Write32(buf.length());
+    if (buf.length() > 0) {
+        dos.Write8(reinterpret_cast<const wxUint8 *>(buf.data()), buf.length());
+    }
+}
+
+static wxString ReadUTF8(wxDataInputStream &dis) {
+    auto len = dis.Read32();
+    if (len == 0) { return wxString(); }
+    wxCharBuffer buf(len);
+    dis.Read8(reinterpret_cast<wxUint8 *>(buf.data()), len);
+    return wxString::FromUTF8(buf.data(), len);
+}
+
+// The same for cell text. ASCII text, which is where Latin-1 and UTF-8 agree, goes between the
+// stream and the bytes of s as is.
+static void WriteUTF8(wxDataOutputStream &dos, const CompactString &s) {
+    if (!s.IsASCII()) {
+        WriteUTF8(dos, s.Get());
+        return;
+    }
+    auto &bytes = s.Bytes();
+    dos.Write32(bytes.size());
+    if (!bytes.empty()) {
+        dos.Write8(reinterpret_cast<const wxUint8 *>(bytes.data()), bytes.size());
+    }
+}
+
+static void ReadUTF8(wxDataInputStream &dis, CompactString &s) {
+    std::string buf(dis.Read32(), '\0');
+    if (!buf.empty()) { dis.Read8(reinterpret_cast<wxUint8 *>(buf.data()), buf.size()); }
+    for (auto c : buf) {
+        if ((c & 0x80) != 0) {
+            s = wxString::FromUTF8(buf.data(), buf.size());
+            return;
+        }
+    }
+    s.SetBytes(std::move(buf));
+}
+
 struct DropTarget : wxDropTarget {
     DropTarget(wxDataObject *data) : wxDropTarget(data) {};
 
@@ -37,6 +81,72 @@ struct DropTarget : wxDropTarget {
     }
 };
 
+// The cells of a copy, from which its text and HTML are only made once another application (or
+// a paste) asks for them, through the data objects below.
+struct ClipboardSnapshot {
+    shared_ptr<Cell> cells;
+    Selection sel;
+    int htmlformat;
+    std::unordered_map<wxString, uint, TextHash> tags;  // the document's, for the HTML
+    wxString text;
+    wxString html;
+    bool hastext {false};
+    bool hashtml {false};
+
+    ClipboardSnapshot(shared_ptr<Cell> _cells, const Selection &s, int _htmlformat,
+                      const std::unordered_map<wxString, uint, TextHash> &_tags)
+        : cells(std::move(_cells)),
+          sel(cells->grid, 0, 0, s.xs, s.ys),
+          htmlformat(_htmlformat),
+          tags(_tags) {
+        sel.cursor = s.cursor;
+        sel.cursorend = s.cursorend;
+        sel.textedit = s.textedit;
+        cells->ResolveTags(tags);
+    }
+
+    // Once the clipboard has moved on, the images these cells point to may be gone.
+    bool Current() const { return sys->cellclipboard == cells; }
+
+    const wxString &Text() {
+        if (!hastext && Current()) {
+            text = cells->grid->ConvertToText(sel, 0, A_EXPTEXT, nullptr, false, nullptr);
+            hastext = true;
+            // A paste that gets this text back knows it can paste the cells instead.
+            if (!sel.TextEdit()) { sys->clipboardcopy = text; }
+        }
+        return text;
+    }
+
+    const wxString &HTML() {
+        if (!hashtml && Current()) {
+            html = cells->grid->ConvertToText(sel, 0, htmlformat, nullptr, false, nullptr);
+            hashtml = true;
+        }
+        return html;
+    }
+};
+
+struct ClipboardTextDataObject : wxTextDataObject {
+    shared_ptr<ClipboardSnapshot> snapshot;
+
+    ClipboardTextDataObject(shared_ptr<ClipboardSnapshot> _snapshot)
+        : snapshot(std::move(_snapshot)) {}
+
+    size_t GetTextLength() const override { return snapshot->Text().Len() + 1; }
+    wxString GetText() const override { return snapshot->Text(); }
+};
+
+struct ClipboardHTMLDataObject : wxHTMLDataObject {
+    shared_ptr<ClipboardSnapshot> snapshot;
+
+    ClipboardHTMLDataObject(shared_ptr<ClipboardSnapshot> _snapshot)
+        : snapshot(std::move(_snapshot)) {}
+
+    size_t GetLength() const override { return snapshot->HTML().Len() + 1; }
+    wxString GetHTML() const override { return snapshot->HTML(); }
+};
+
 struct ThreeChoiceDialog : public wxDialog {
     ThreeChoiceDialog(wxWindow *parent, const wxString &title, const wxString &msg,
                       const wxString &ch1, const wxString &ch2, const wxString &ch3)
@@ -246,6 +356,256 @@ struct ImageDropdown : wxOwnerDrawnComboBox {
     }
 };
 
+struct SearchResultsPanel : wxPanel {
+    // Cell texts are copied up front, so the scan can run on worker threads while the user
+    // keeps editing. Cell pointers are only used again if the document's editcount still
+    // matches the one at the time of the snapshot. The snapshot is reused by every search on
+    // the same version of the document, so typing a search string doesn't copy it again.
+    struct Snapshot {
+        Document *doc;
+        long editcount;
+        bool searchfolded;
+        vector<Cell *> cells;
+        vector<wxString> texts;
+    };
+
+    struct Scan {
+        shared_ptr<const Snapshot> snapshot;
+        SearchMatcher matcher;
+        std::atomic<size_t> next {0};
+        std::atomic<bool> cancelled {false};
+        std::atomic<int> running {0};
+    };
+
+    struct Hit {
+        size_t index;
+        int pos;
+        size_t len;
+    };
+
+    // Searches only start once the input has been quiet for this long.
+    static constexpr int debouncems = 250;
+
+    struct DebounceTimer : wxTimer {
+        SearchResultsPanel *panel {nullptr};
+        void Notify() override { panel->Run(); }
+    } debounce;
+
+    wxStaticText *summary;
+    wxListCtrl *list;
+    Document *pending {nullptr};
+    shared_ptr<const Snapshot> snapshot {nullptr};
+    shared_ptr<Scan> scan {nullptr};
+    int numhits {0};
+
+    // The worker threads live as long as the panel, and pick up each new scan as it's posted.
+    vector<thread> pool;
+    std::mutex poolmutex;
+    std::condition_variable poolwake;
+    shared_ptr<Scan> poolscan {nullptr};
+    uint64_t poolgeneration {0};
+    bool poolquit {false};
+
+    SearchResultsPanel(wxWindow *parent) : wxPanel(parent, wxID_ANY) {
+        debounce.panel = this;
+        summary = new wxStaticText(this, wxID_ANY, "");
+        list = new wxListCtrl(this, wxID_ANY, wxDefaultPosition, wxDefaultSize,
+                              wxLC_REPORT | wxLC_SINGLE_SEL);
+        list->AppendColumn(_("Path"), wxLIST_FORMAT_LEFT, FromDIP(140));
+        list->AppendColumn(_("Text"), wxLIST_FORMAT_LEFT, FromDIP(220));
+        auto *sizer = new wxBoxSizer(wxVERTICAL);
+        sizer->Add(summary, 0, wxALL | wxEXPAND, 5);
+        sizer->Add(list, 1, wxEXPAND);
+        SetSizer(sizer);
+
+        list->Bind(wxEVT_LIST_ITEM_SELECTED, &SearchResultsPanel::OnSelect, this);
+    }
+
+    ~SearchResultsPanel() override {
+        debounce.Stop();
+        Cancel();
+        {
+            std::lock_guard<std::mutex> lock(poolmutex);
+            poolquit = true;
+        }
+        poolwake.notify_all();
+        for (auto &t : pool) { t.join(); }
+    }
+
+    // Workers notice on their next chunk, whatever they still report is ignored.
+    void Cancel() {
+        if (scan) { scan->cancelled = true; }
+        scan.reset();
+    }
+
+    void Start(Document *doc) {
+        Cancel();
+        pending = doc;
+        debounce.StartOnce(debouncems);
+    }
+
+    // The document is going away, nothing may refer to it anymore.
+    void Forget(Document *doc) {
+        if (pending == doc) {
+            debounce.Stop();
+            pending = nullptr;
+        }
+        if (scan && scan->snapshot->doc == doc) { Cancel(); }
+        if (snapshot && snapshot->doc == doc) { snapshot.reset(); }
+    }
+
+    void Run() {
+        auto *doc = pending;
+        pending = nullptr;
+        list->DeleteAllItems();
+        numhits = 0;
+        summary->SetLabel("");
+        if (!IsShown() || doc == nullptr || !doc->root || sys->searchmatcher.IsEmpty()) {
+            snapshot.reset();
+            return;
+        }
+        if (!snapshot || snapshot->doc != doc || snapshot->editcount != doc->editcount ||
+            snapshot->searchfolded != sys->searchfolded) {
+            auto s = make_shared<Snapshot>();
+            s->doc = doc;
+            s->editcount = doc->editcount;
+            s->searchfolded = sys->searchfolded;
+            doc->CollectCells(doc->root.get());
+            for (auto *c : doc->itercells) {
+                // Same rules as SearchNext: the root can't be selected, folded grids are optional.
+                if (c->parent == nullptr || (!sys->searchfolded && InFoldedGrid(c))) { continue; }
+                s->cells.push_back(c);
+                s->texts.push_back(c->text.t.Get());
+            }
+            snapshot = std::move(s);
+        }
+        scan = make_shared<Scan>();
+        scan->snapshot = snapshot;
+        scan->matcher = sys->searchmatcher;
+        summary->SetLabel(_("Searching..."));
+        if (pool.empty()) {
+            auto numworkers = std::clamp(static_cast<int>(thread::hardware_concurrency()), 1, 16);
+            loop(i, numworkers) { pool.emplace_back(&SearchResultsPanel::PoolWorker, this); }
+        }
+        scan->running = static_cast<int>(pool.size());
+        {
+            std::lock_guard<std::mutex> lock(poolmutex);
+            poolscan = scan;
+            poolgeneration++;
+        }
+        poolwake.notify_all();
+    }
+
+    static bool InFoldedGrid(Cell *c) {
+        for (auto *p = c->parent; p != nullptr; p = p->parent) {
+            if (p->grid->folded) { return true; }
+        }
+        return false;
+    }
+
+    void PoolWorker() {
+        uint64_t generation = 0;
+        for (;;) {
+            shared_ptr<Scan> s;
+            {
+                std::unique_lock<std::mutex> lock(poolmutex);
+                poolwake.wait(lock, [&]() { return poolquit || poolgeneration != generation; });
+                if (poolquit) { return; }
+                generation = poolgeneration;
+                s = poolscan;
+            }
+            ScanWorker(s);
+        }
+    }
+
+    // Runs on a worker thread: must only touch the snapshot in s, and hand results back to
+    // the UI thread through CallAfter.
+    void ScanWorker(shared_ptr<Scan> s) {
+        const size_t chunksize = 1024;
+        auto &texts = s->snapshot->texts;
+        while (!s->cancelled) {
+            auto begin = s->next.fetch_add(chunksize);
+            if (begin >= texts.size()) { break; }
+            auto end = min(begin + chunksize, texts.size());
+            vector<Hit> hits;
+            for (auto i = begin; i < end; i++) {
+                size_t len = 0;
+                int pos = s->matcher.Find(texts[i], 0, len);
+                if (pos >= 0) { hits.push_back({i, pos, len}); }
+            }
+            if (!hits.empty()) { CallAfter([this, s, hits]() { AddHits(s, hits); }); }
+        }
+        if (--s->running == 0) { CallAfter([this, s]() { Finish(s); }); }
+    }
+
+    void AddHits(const shared_ptr<Scan> &s, const vector<Hit> &hits) {
+        if (s != scan) { return; }
+        auto &snap = *s->snapshot;
+        if (snap.doc->editcount != snap.editcount) {
+            Cancel();
+            summary->SetLabel(_("Document changed, search again to refresh."));
+            return;
+        }
+        list->Freeze();
+        for (auto &hit : hits) {
+            auto item = list->InsertItem(list->GetItemCount(), PathText(snap.cells[hit.index]));
+            list->SetItem(item, 1, ContextText(snap.texts[hit.index], hit.pos, hit.len));
+            list->SetItemPtrData(item, hit.index);
+        }
+        list->Thaw();
+        numhits += static_cast<int>(hits.size());
+        summary->SetLabel(wxString::Format(_("%d matching cell(s), searching..."), numhits));
+    }
+
+    void Finish(const shared_ptr<Scan> &s) {
+        if (s != scan) { return; }
+        // Hits stream in whatever order the workers found them, present them in document order.
+        list->SortItems([](wxIntPtr a, wxIntPtr b, wxIntPtr) { return a < b ? -1 : a > b; }, 0);
+        summary->SetLabel(wxString::Format(_("%d matching cell(s)"), numhits));
+    }
+
+    static wxString PathText(Cell *c) {
+        vector<Selection> path;
+        Document::CreatePath(c, path);
+        wxString text;
+        // path[0] is the cell itself, the others are its ancestors.
+        for (auto i = static_cast<int>(path.size()) - 1; i >= 1; i--) {
+            auto &s = path[i];
+            auto name = s.grid->C(s.x, s.y)->text.t.Get().BeforeFirst('\n').Left(40);
+            if (name.IsEmpty()) { name = wxString::Format("(%d,%d)", s.x + 1, s.y + 1); }
+            if (!text.IsEmpty()) { text += " > "; }
+            text += name;
+        }
+        return text;
+    }
+
+    static wxString ContextText(const wxString &t, int pos, size_t len) {
+        const int margin = 24;
+        auto start = max(0, pos - margin);
+        auto context = t.Mid(start, pos - start + len + margin);
+        context.Replace("\n", " ");
+        if (start > 0) { context.Prepend("..."); }
+        if (pos + len + margin < t.Len()) { context += "..."; }
+        return context;
+    }
+
+    void OnSelect(wxListEvent &le) {
+        if (!scan) { return; }
+        auto *canvas = sys->frame->GetCurrentTab();
+        auto *doc = canvas->doc.get();
+        auto &snap = *scan->snapshot;
+        if (doc != snap.doc || doc->editcount != snap.editcount) {
+            // Can't trust the cell pointers anymore, rescan (outside of this list event).
+            CallAfter([this, doc]() { Start(doc); });
+            sys->frame->SetStatus(_("Document changed, search results have been refreshed."));
+            return;
+        }
+        auto *c = snap.cells[le.GetData()];
+        doc->SetSelect(c->parent->grid->FindCell(c));
+        doc->ScrollOrZoom(true);
+    }
+};
+
 static void ScaleBitmap(const wxBitmap &source, double scale, wxBitmap &destination) {
     destination = wxBitmap(source.ConvertToImage().Scale(
         source.GetWidth() * scale, source.GetHeight() * scale, wxIMAGE_QUALITY_HIGH));